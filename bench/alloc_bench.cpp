@@ -0,0 +1,126 @@
+// Counts heap allocations made while building and submitting one query:
+// construction with scalar params, the moves on the way to a loop, the
+// scheduler backlog of the loop and the libpq parameter arrays. Needs no
+// database server.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include "../src/db/query.hpp"
+#include "../src/db/mpsc_ring.hpp"
+#include "../src/db/scheduler.hpp"
+
+namespace {
+    std::atomic<std::size_t> allocations{0};
+}
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+    
+    template <typename F>
+    void measure(const char* name, int iterations, F&& body) {
+        body(); // warm up scratch buffers
+        std::size_t before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            body();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+        double allocs = (double)(allocations.load() - before) / iterations;
+        std::printf("%-28s %10.1f ns/op %8.2f allocs/op\n", name, ns, allocs);
+    }
+    
+    // What connection::send hands to PQsendQueryParams
+    std::size_t fill_arrays(const db::query& q) {
+        static thread_local std::vector<const char*> values;
+        static thread_local std::vector<int> lengths;
+        static thread_local std::vector<int> formats;
+        values.clear();
+        lengths.clear();
+        formats.clear();
+        for(auto& p: q.params()) {
+            values.push_back((const char*)p.data());
+            lengths.push_back((int)p.len());
+            formats.push_back((int)p.is_binary());
+        }
+        return values.size();
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    // Long enough to defeat small string optimization, moved in by callers
+    // which build SQL once
+    const std::string sql = "UPDATE users SET name = $1, male = $2 WHERE id = $3";
+    std::size_t sink = 0;
+    int* counter = &iterations;
+    
+    measure("construct (sql copied)", iterations, [&] {
+        db::query q(sql, {
+            db::query::param::text("john"),
+            db::query::param::boolean(true),
+            db::query::param::int64(42)
+        }, [counter](std::list<PGresult*>) { ++*counter; });
+        sink += q.params().size();
+    });
+    
+    std::string moved = sql;
+    measure("construct (sql moved)", iterations, [&] {
+        db::query q(std::move(moved), {
+            db::query::param::text("john"),
+            db::query::param::boolean(true),
+            db::query::param::int64(42)
+        }, [counter](std::list<PGresult*>) { ++*counter; });
+        moved = std::move(const_cast<std::string&>(q.sql()));
+    });
+    
+    db::mpsc_ring<db::query> ring(1024);
+    measure("submit + take + send arrays", iterations, [&] {
+        db::query q(std::move(moved), {
+            db::query::param::text("john"),
+            db::query::param::boolean(true),
+            db::query::param::int64(42)
+        }, [counter](std::list<PGresult*>) { ++*counter; });
+        ring.push(std::move(q));
+        db::query taken;
+        ring.pop(taken);
+        db::query command = std::move(taken);
+        sink += fill_arrays(command);
+        moved = std::move(const_cast<std::string&>(command.sql()));
+    });
+    
+    // A backlog of 64 queries over 4 tags, flows drain and come back
+    db::scheduler backlog(db::scheduler::weights_t{{1, 2}});
+    std::vector<db::query> batch(64);
+    measure("scheduler push + pop (x64)", iterations / 64, [&] {
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            batch[i].schedule(db::priority::normal, (uint32_t)(i % 4));
+            backlog.push(std::move(batch[i]));
+        }
+        for (auto& q: batch) {
+            backlog.pop(q);
+        }
+        sink += backlog.size();
+    });
+    
+    return sink == 0;
+}
@@ -0,0 +1,96 @@
+// Throughput of COPY ... TO STDOUT through connection_pool::copy_to.
+// Needs a running server:
+//   copy_out_bench "host=127.0.0.1 dbname=sample user=sample password=123" [rows] [output file]
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../src/db/connection_pool.hpp"
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <conninfo> [rows] [output file]\n", argv[0]);
+        return 1;
+    }
+    
+    db::connect_param_t params;
+    std::istringstream conninfo(argv[1]);
+    std::string pair;
+    while (conninfo >> pair) {
+        auto eq = pair.find('=');
+        if (eq != std::string::npos) {
+            params[pair.substr(0, eq)] = pair.substr(eq + 1);
+        }
+    }
+    long rows = argc > 2 ? std::atol(argv[2]) : 5000000;
+    int fd = -1;
+    if (argc > 3) {
+        fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            std::perror("open");
+            return 1;
+        }
+    }
+    
+    db::connection_pool pool(1);
+    pool.run(params);
+    
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> chunks{0};
+    
+    db::copy_out::sink_t sink;
+    if (fd != -1) {
+        auto to_fd = db::copy_out::to_fd(fd);
+        sink = [to_fd, &bytes, &chunks](const char* data, std::size_t len) {
+            bytes += len;
+            ++chunks;
+            return to_fd(data, len);
+        };
+    }
+    else {
+        sink = [&bytes, &chunks](const char*, std::size_t len) {
+            bytes += len;
+            ++chunks;
+            return true;
+        };
+    }
+    
+    std::string sql = "COPY (SELECT g, md5(g::text), now() FROM generate_series(1, " +
+                      std::to_string(rows) + ") g) TO STDOUT";
+    auto start = std::chrono::steady_clock::now();
+    pool.copy_to(sql, sink, [&](int64_t copied, const std::string& error) {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (copied < 0) {
+            std::printf("copy failed: %s\n", error.c_str());
+        }
+        else {
+            double mb = bytes.load() / (1024.0 * 1024.0);
+            std::printf("rows %lld, %.1f MB in %llu chunks, %.3f s, %.1f MB/s\n",
+                        (long long)copied, mb, (unsigned long long)chunks.load(), elapsed, mb / elapsed);
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        done = true;
+        cv.notify_one();
+    });
+    
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&done] {
+            return done;
+        });
+    }
+    pool.stop();
+    if (fd != -1) {
+        close(fd);
+    }
+    return 0;
+}
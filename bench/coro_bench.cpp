@@ -0,0 +1,133 @@
+// Coroutine clients on top of connection_pool, built as C++20. Every client
+// is a detached db::task running queries one after another with
+// co_await pool.query(), half of them through a nested db::task<int64_t>.
+// Reports throughput and heap allocations per query against the bundled stub
+// server:
+//   coro_bench [--clients=256] [--queries=200] [--connections=8] [--threads=1]
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include "../src/db/connection_pool.hpp"
+#include "../src/db/task.hpp"
+#include "stub_server.hpp"
+
+#if !defined(__cpp_impl_coroutine)
+#error "coro_bench needs C++20 coroutines"
+#endif
+
+namespace {
+    std::atomic<std::size_t> allocations{0};
+}
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+    struct run_state {
+        db::connection_pool* pool = nullptr;
+        int queries = 0;
+        std::atomic<long> failed{0};
+        std::atomic<int> running{0};
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+
+    db::task<int64_t> lookup(db::connection_pool& pool, int64_t id) {
+        db::query::params_t params;
+        params.push_back(db::query::param::int64(id));
+        db::results_t results = co_await pool.query("SELECT id, value FROM items WHERE id = $1", std::move(params));
+        co_return results.empty() ? -1 : (int64_t)results.front().size();
+    }
+
+    db::task<void> client(run_state& state, int id) {
+        for (int i = 0; i < state.queries; ++i) {
+            bool ok;
+            if (i % 2) {
+                ok = co_await lookup(*state.pool, id) >= 0;
+            }
+            else {
+                db::results_t results = co_await state.pool->query("SELECT 1");
+                ok = !results.empty();
+            }
+            if (!ok) {
+                state.failed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if (state.running.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(state.mtx);
+            state.cv.notify_all();
+        }
+    }
+
+    int number(int argc, const char* argv[], const char* name, int fallback) {
+        std::size_t len = std::strlen(name);
+        for (int i = 1; i < argc; ++i) {
+            if (std::strncmp(argv[i], "--", 2) == 0 && std::strncmp(argv[i] + 2, name, len) == 0 &&
+                argv[i][len + 2] == '=') {
+                return std::atoi(argv[i] + len + 3);
+            }
+        }
+        return fallback;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    int clients = number(argc, argv, "clients", 256);
+
+    stub::server server;
+    server.start();
+    db::pool_options options;
+    options.threads = number(argc, argv, "threads", 1);
+    db::connection_pool pool(number(argc, argv, "connections", 8), options);
+    pool.run({
+        {"host", "127.0.0.1"}, {"port", std::to_string(server.port())},
+        {"dbname", "stub"}, {"user", "stub"}, {"sslmode", "disable"}
+    });
+
+    run_state state;
+    state.pool = &pool;
+    state.queries = number(argc, argv, "queries", 200);
+    state.running = clients;
+
+    std::size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < clients; ++i) {
+        client(state, i).detach();
+    }
+    {
+        std::unique_lock<std::mutex> lock(state.mtx);
+        state.cv.wait(lock, [&state] {
+            return state.running.load() == 0;
+        });
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::size_t allocs = allocations.load() - before;
+    pool.stop();
+    server.stop();
+
+    long total = (long)clients * state.queries;
+    std::printf("%d clients x %d queries, %.2f s, %.0f queries/s, %.2f allocs/query, %ld failed\n",
+                clients, state.queries, seconds, total / seconds, (double)allocs / total, state.failed.load());
+    return state.failed.load() != 0;
+}
@@ -0,0 +1,177 @@
+// End to end load through connection_pool. Keeps a fixed number of queries in
+// flight and reports throughput and latency percentiles from submission to
+// handler. Runs against the bundled stub server unless a conninfo is given:
+//   load_gen [--queries=200000] [--concurrency=256] [--mode=simple|params|insert]
+//            [--connections=8] [--threads=1] [--pipeline=0] [--statements=0] [--coalesce=0]
+//            [--latency-us=0] [--jitter-us=0] [--rows=1] [--row-bytes=16]
+//            [--error-rate=0] [--disconnect-rate=0]
+//            [--conninfo="host=127.0.0.1 dbname=sample user=sample password=123"]
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include "../src/db/bind.hpp"
+#include "../src/db/connection_pool.hpp"
+#include "../src/db/metrics.hpp"
+#include "stub_server.hpp"
+
+namespace {
+
+    std::map<std::string, std::string> parse_args(int argc, const char* argv[]) {
+        std::map<std::string, std::string> args;
+        for (int i = 1; i < argc; ++i) {
+            const char* arg = argv[i];
+            if (std::strncmp(arg, "--", 2) != 0) {
+                continue;
+            }
+            const char* eq = std::strchr(arg, '=');
+            if (eq) {
+                args[std::string(arg + 2, eq)] = eq + 1;
+            }
+            else {
+                args[arg + 2] = "1";
+            }
+        }
+        return args;
+    }
+
+    struct load {
+        db::connection_pool* pool = nullptr;
+        std::string mode;
+        long total = 0;
+        std::atomic<long> submitted{0};
+        std::atomic<long> completed{0};
+        std::atomic<long> failed{0};
+        db::histogram latency;
+        std::mutex mtx;
+        std::condition_variable cv;
+
+        db::query make(long n) {
+            using clock = std::chrono::steady_clock;
+            auto started = clock::now();
+            auto handler = [this, started](std::list<PGresult*> results) {
+                latency.record(clock::now() - started);
+                bool ok = !results.empty();
+                for(auto r: results) {
+                    ExecStatusType status = PQresultStatus(r);
+                    ok = ok && (status == PGRES_TUPLES_OK || status == PGRES_COMMAND_OK);
+                    PQclear(r);
+                }
+                if (!ok) {
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                }
+                next();
+                if (completed.fetch_add(1) + 1 == total) {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    cv.notify_all();
+                }
+            };
+            if (mode == "params") {
+                return db::make_query<int64_t>("SELECT id, value FROM items WHERE id = $1", n, std::move(handler));
+            }
+            if (mode == "insert") {
+                return db::make_query<int64_t, std::string_view>("INSERT INTO items(id, value) VALUES ($1, $2)",
+                                                                 n, "load", std::move(handler));
+            }
+            return db::query("SELECT 1", std::move(handler));
+        }
+
+        // Keeps the number of queries in flight constant
+        void next() {
+            long n = submitted.fetch_add(1);
+            if (n < total) {
+                pool->async_query(make(n));
+            }
+        }
+    };
+
+    void print_latency(const char* name, const db::histogram::snapshot& h) {
+        std::printf("%-12s p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  mean %9.1f us\n", name,
+                    h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.mean() / 1e3);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    auto args = parse_args(argc, argv);
+    auto number = [&args](const char* name, double fallback) {
+        auto it = args.find(name);
+        return it == args.end() ? fallback : std::atof(it->second.c_str());
+    };
+
+    std::unique_ptr<stub::server> server;
+    db::connect_param_t params;
+    if (args.count("conninfo")) {
+        std::istringstream conninfo(args["conninfo"]);
+        std::string pair;
+        while (conninfo >> pair) {
+            auto eq = pair.find('=');
+            if (eq != std::string::npos) {
+                params[pair.substr(0, eq)] = pair.substr(eq + 1);
+            }
+        }
+    }
+    else {
+        stub::server_options options;
+        options.latency = std::chrono::microseconds((long)number("latency-us", 0));
+        options.jitter = std::chrono::microseconds((long)number("jitter-us", 0));
+        options.rows = (int)number("rows", 1);
+        options.row_bytes = (int)number("row-bytes", 16);
+        options.error_rate = number("error-rate", 0);
+        options.disconnect_rate = number("disconnect-rate", 0);
+        server.reset(new stub::server(options));
+        server->start();
+        params = {
+            {"host", "127.0.0.1"}, {"port", std::to_string(server->port())},
+            {"dbname", "stub"}, {"user", "stub"}, {"sslmode", "disable"}
+        };
+    }
+
+    db::pool_options options;
+    options.threads = (int)number("threads", 1);
+    options.pipeline_depth = (int)number("pipeline", 0);
+    options.statement_cache = (std::size_t)number("statements", 0);
+    options.coalesce = (std::size_t)number("coalesce", 0);
+    db::connection_pool pool((int)number("connections", 8), options);
+    pool.run(params);
+
+    load l;
+    l.pool = &pool;
+    l.mode = args.count("mode") ? args["mode"] : "simple";
+    l.total = (long)number("queries", 200000);
+    long concurrency = std::min<long>(l.total, (long)number("concurrency", 256));
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < concurrency; ++i) {
+        l.next();
+    }
+    {
+        std::unique_lock<std::mutex> lock(l.mtx);
+        l.cv.wait(lock, [&l] {
+            return l.completed.load() >= l.total;
+        });
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    pool.stop();
+
+    auto pool_stats = pool.snapshot();
+    std::printf("%ld queries (%s), %ld in flight, %.2f s, %.0f queries/s, %ld failed\n", l.total, l.mode.c_str(),
+                concurrency, seconds, l.total / seconds, l.failed.load());
+    print_latency("latency", l.latency.take());
+    print_latency("queue wait", pool_stats.queue_wait);
+    print_latency("first byte", pool_stats.first_byte);
+    if (server) {
+        auto& s = server->stats();
+        std::printf("server: %llu connections, %llu statements, %llu errors, %llu disconnects\n",
+                    (unsigned long long)s.connections.load(), (unsigned long long)s.statements.load(),
+                    (unsigned long long)s.errors.load(), (unsigned long long)s.disconnects.load());
+        server->stop();
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Measures what metrics cost on the hot path: histogram records and counter
+// updates done for every query, alone and with threads contending on the
+// same metrics. Needs no database server.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "../src/db/metrics.hpp"
+#include "../src/db/query.hpp"
+
+namespace {
+
+    template <typename F>
+    double measure(int iterations, F&& body) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            body(i);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    }
+
+    // Everything the pool records for one query, outside of the handler
+    void record_query(db::metrics& m, uint64_t ns) {
+        m.queue_wait.record(ns);
+        m.first_byte.record(ns * 2);
+        m.total.record(ns * 3);
+        m.queries.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+    db::metrics m;
+    double ns = measure(iterations, [&m](int i) {
+        m.total.record((uint64_t)i * 997);
+    });
+    std::printf("%-28s %10.1f ns/op\n", "histogram record", ns);
+
+    ns = measure(iterations, [&m](int i) {
+        record_query(m, (uint64_t)i * 997);
+    });
+    std::printf("%-28s %10.1f ns/op\n", "per query records", ns);
+
+    // call_handler with and without metrics attached
+    for (int with_metrics = 0; with_metrics < 2; ++with_metrics) {
+        ns = measure(iterations, [&m, with_metrics](int) {
+            db::query q("SELECT 1", [](std::list<PGresult*>) {});
+            if (with_metrics) {
+                q.complete_on(nullptr, &m);
+            }
+            q.set_enqueued(std::chrono::steady_clock::now());
+            q.call_handler({});
+        });
+        std::printf("%-28s %10.1f ns/op\n", with_metrics ? "query + handler, metrics" : "query + handler", ns);
+    }
+
+    for (int threads: {2, 4, 8}) {
+        db::metrics shared;
+        int per_thread = iterations / threads;
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&shared, per_thread] {
+                for (int i = 0; i < per_thread; ++i) {
+                    record_query(shared, (uint64_t)i * 997);
+                }
+            });
+        }
+        for(auto& w: workers) {
+            w.join();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        ns = std::chrono::duration<double, std::nano>(elapsed).count() / ((double)per_thread * threads);
+        std::printf("per query records, %d thr   %10.1f ns/op\n", threads, ns);
+    }
+
+    auto snap = m.take();
+    std::printf("p50 %llu ns, p99 %llu ns, p999 %llu ns of %llu samples\n",
+                (unsigned long long)snap.total.percentile(0.5), (unsigned long long)snap.total.percentile(0.99),
+                (unsigned long long)snap.total.percentile(0.999), (unsigned long long)snap.total.count);
+    return 0;
+}
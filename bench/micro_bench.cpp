@@ -0,0 +1,253 @@
+// Hot path micro benchmarks reporting ns/op and allocs/op: parameter encoding,
+// query construction, moves and completion, async_query enqueue from 1 to 64 producer
+// threads, the drain and dispatch steps of an event loop and the logger.
+// Needs no database server:
+//     micro_bench [iterations]
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../src/db/bind.hpp"
+#include "../src/db/connection_pool.hpp"
+#include "../src/db/mpsc_ring.hpp"
+#include "../src/db/scheduler.hpp"
+#include "../src/logger/logger.hpp"
+
+namespace {
+    std::atomic<std::size_t> allocations{0};
+}
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+    void report(const char* name, std::chrono::steady_clock::duration elapsed, std::size_t ops, std::size_t allocs) {
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+        std::printf("%-32s %10.1f ns/op %8.2f allocs/op\n", name, ns, (double)allocs / ops);
+    }
+
+    template <typename F>
+    void measure(const char* name, int iterations, F&& body) {
+        body(); // warm up scratch buffers
+        std::size_t before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            body();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        report(name, elapsed, iterations, allocations.load() - before);
+    }
+
+    const std::string sql = "UPDATE users SET name = $1, male = $2 WHERE id = $3";
+    std::size_t sink = 0;
+
+    db::query make_query() {
+        return db::make_query<std::string_view, bool, int64_t>(sql, "john", true, 42, [](std::list<PGresult*>) {
+            ++sink;
+        });
+    }
+
+    void bench_params(int iterations) {
+        measure("param int32", iterations, [] {
+            sink += db::query::param::int32(42).len();
+        });
+        measure("param text", iterations, [] {
+            sink += db::query::param::text("john").len();
+        });
+        measure("param text > inline_size", iterations, [] {
+            sink += db::query::param::text("john.doe@example.com").len();
+        });
+        measure("bind<int64_t>", iterations, [] {
+            sink += db::bind<int64_t>::encode(42).len();
+        });
+        measure("bind<double>", iterations, [] {
+            sink += db::bind<double>::encode(4.2).len();
+        });
+    }
+
+    void bench_queries(int iterations) {
+        measure("query construct", iterations, [] {
+            db::query q = make_query();
+            sink += q.params().size();
+        });
+        db::query held = make_query();
+        measure("query move x2", iterations, [&held] {
+            db::query moved = std::move(held);
+            held = std::move(moved);
+        });
+        measure("query construct + handler", iterations, [] {
+            db::query q = make_query();
+            q.call_handler({});
+        });
+        // Same with completion accounting and a hop through an executor
+        struct inline_executor: db::executor {
+            void post(task_t task) override {
+                task();
+            }
+        } on;
+        db::metrics stats;
+        measure("query construct + executor", iterations, [&on, &stats] {
+            db::query q = make_query();
+            q.complete_on(&on, &stats);
+            q.call_handler({});
+        });
+    }
+
+    // Queries are never taken by a loop here, rounds stay below the ring
+    // capacity so every push takes the lock-free path
+    void bench_enqueue(int iterations) {
+        const std::size_t round = db::connection_pool::submit_capacity / 2;
+        for (int threads: {1, 2, 4, 8, 16, 32, 64}) {
+            std::size_t per_thread = round / threads;
+            std::size_t rounds = std::max<std::size_t>(1, iterations / round);
+            std::chrono::steady_clock::duration elapsed{};
+            std::size_t allocs = 0;
+            for (std::size_t r = 0; r < rounds; ++r) {
+                db::connection_pool pool(1);
+                std::atomic<int> ready{0};
+                std::atomic<bool> go{false};
+                std::vector<std::thread> producers;
+                for (int t = 0; t < threads; ++t) {
+                    producers.emplace_back([&] {
+                        std::vector<db::query> queries;
+                        queries.reserve(per_thread);
+                        for (std::size_t i = 0; i < per_thread; ++i) {
+                            queries.push_back(make_query());
+                        }
+                        ready.fetch_add(1);
+                        while (!go.load()) {
+                            std::this_thread::yield();
+                        }
+                        for(auto& q: queries) {
+                            pool.async_query(std::move(q));
+                        }
+                    });
+                }
+                while (ready.load() < threads) {
+                    std::this_thread::yield();
+                }
+                std::size_t before = allocations.load();
+                auto start = std::chrono::steady_clock::now();
+                go.store(true);
+                for(auto& p: producers) {
+                    p.join();
+                }
+                elapsed += std::chrono::steady_clock::now() - start;
+                allocs += allocations.load() - before;
+            }
+            char name[64];
+            std::snprintf(name, sizeof(name), "async_query, %d producers", threads);
+            report(name, elapsed, rounds * per_thread * threads, allocs);
+        }
+    }
+
+    // What a loop does with a query between its submission ring and
+    // connection::send, without the connection
+    void bench_dispatch(int iterations) {
+        const std::size_t batch = 256;
+        db::mpsc_ring<db::query> ring(batch);
+        db::scheduler queue;
+        std::vector<db::query> batch_queries;
+        auto prepare = [&] {
+            batch_queries.clear();
+            for (std::size_t i = 0; i < batch; ++i) {
+                batch_queries.push_back(make_query());
+            }
+        };
+        prepare();
+        std::chrono::steady_clock::duration elapsed{};
+        std::size_t allocs = 0;
+        std::size_t ops = 0;
+        static thread_local std::vector<const char*> values;
+        while (ops < (std::size_t)iterations) {
+            for(auto& q: batch_queries) {
+                ring.push(std::move(q));
+            }
+            std::size_t before = allocations.load();
+            auto start = std::chrono::steady_clock::now();
+            ring.drain([&queue](db::query&& q) {
+                queue.push(std::move(q));
+            });
+            db::query q;
+            while (queue.pop(q)) {
+                values.clear();
+                for(auto& p: q.params()) {
+                    values.push_back((const char*)p.data());
+                }
+                sink += values.size();
+            }
+            elapsed += std::chrono::steady_clock::now() - start;
+            allocs += allocations.load() - before;
+            ops += batch;
+            prepare();
+        }
+        report("drain + schedule + dispatch", elapsed, ops, allocs);
+    }
+
+    // Console output goes to /dev/null meanwhile. Lines the writer thread
+    // could not keep up with are dropped, not waited for
+    void bench_logger(int iterations) {
+        std::fflush(stdout);
+        int out = dup(1);
+        int err = dup(2);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        std::size_t before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            log_info("[db] pool[%d] connected", i);
+        }
+        auto info = std::chrono::steady_clock::now() - start;
+        std::size_t info_allocs = allocations.load() - before;
+        before = allocations.load();
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            log_error("[db] pool[%d] consume failed: %s", i, "server closed the connection unexpectedly");
+        }
+        auto error = std::chrono::steady_clock::now() - start;
+        std::size_t error_allocs = allocations.load() - before;
+        log_flush();
+        std::fflush(stdout);
+        dup2(out, 1);
+        dup2(err, 2);
+        close(out);
+        close(err);
+        close(null);
+        report("log_info", info, iterations, info_allocs);
+        report("log_error", error, iterations, error_allocs);
+        std::printf("%-32s %10llu lines\n", "log dropped", (unsigned long long)log_dropped());
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+    bench_params(iterations);
+    bench_queries(iterations);
+    bench_enqueue(iterations);
+    bench_dispatch(iterations);
+    bench_logger(iterations / 10);
+
+    return sink == 0;
+}
@@ -0,0 +1,901 @@
+#include "stub_server.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+namespace stub {
+
+    using clock = std::chrono::steady_clock;
+
+    namespace {
+
+        const int32_t protocol_v3 = 196608;
+        const int32_t ssl_request = 80877103;
+        const int32_t gssenc_request = 80877104;
+        const int32_t cancel_request = 80877102;
+        const int32_t oid_int4 = 23;
+        const int32_t oid_text = 25;
+
+        // Builds one backend message, the length is filled in by done()
+        class message {
+        public:
+            explicit message(char type) {
+                _data.push_back(type);
+                _data.append(4, '\0');
+            }
+            message& int8(char value) {
+                _data.push_back(value);
+                return *this;
+            }
+            message& int16(int16_t value) {
+                uint16_t be = htons((uint16_t)value);
+                _data.append((const char*)&be, 2);
+                return *this;
+            }
+            message& int32(int32_t value) {
+                uint32_t be = htonl((uint32_t)value);
+                _data.append((const char*)&be, 4);
+                return *this;
+            }
+            message& str(const std::string& value) {
+                _data.append(value.c_str(), value.size() + 1);
+                return *this;
+            }
+            message& bytes(const char* data, std::size_t len) {
+                _data.append(data, len);
+                return *this;
+            }
+            std::string done() {
+                uint32_t len = htonl((uint32_t)(_data.size() - 1));
+                std::memcpy(&_data[1], &len, 4);
+                return std::move(_data);
+            }
+        private:
+            std::string _data;
+        };
+
+        // Reads fields of one frontend message
+        class reader {
+        public:
+            reader(const char* data, std::size_t len) : _data(data), _end(data + len) {}
+            bool ok() const {
+                return _ok;
+            }
+            int16_t int16() {
+                uint16_t be = 0;
+                take(&be, 2);
+                return (int16_t)ntohs(be);
+            }
+            int32_t int32() {
+                uint32_t be = 0;
+                take(&be, 4);
+                return (int32_t)ntohl(be);
+            }
+            char int8() {
+                char c = 0;
+                take(&c, 1);
+                return c;
+            }
+            std::string str() {
+                const char* zero = (const char*)std::memchr(_data, 0, _end - _data);
+                if (!zero) {
+                    _ok = false;
+                    _data = _end;
+                    return std::string();
+                }
+                std::string value(_data, zero);
+                _data = zero + 1;
+                return value;
+            }
+            void skip(std::size_t len) {
+                if ((std::size_t)(_end - _data) < len) {
+                    _ok = false;
+                    _data = _end;
+                    return;
+                }
+                _data += len;
+            }
+            std::string rest() {
+                std::string value(_data, _end);
+                _data = _end;
+                return value;
+            }
+        private:
+            void take(void* out, std::size_t len) {
+                if ((std::size_t)(_end - _data) < len) {
+                    _ok = false;
+                    _data = _end;
+                    return;
+                }
+                std::memcpy(out, _data, len);
+                _data += len;
+            }
+            const char* _data;
+            const char* _end;
+            bool _ok = true;
+        };
+
+        std::string error_response(const char* severity, const char* sqlstate, const std::string& text) {
+            message m('E');
+            m.int8('S').str(severity).int8('V').str(severity).int8('C').str(sqlstate).int8('M').str(text).int8(0);
+            return m.done();
+        }
+
+        std::string first_word(const std::string& sql) {
+            std::size_t begin = 0;
+            while (begin < sql.size() && (std::isspace((unsigned char)sql[begin]) || sql[begin] == '(')) {
+                ++begin;
+            }
+            std::string word;
+            while (begin < sql.size() && std::isalpha((unsigned char)sql[begin])) {
+                word += (char)std::toupper((unsigned char)sql[begin++]);
+            }
+            return word;
+        }
+
+        bool contains(const std::string& sql, const char* what) {
+            auto it = std::search(sql.begin(), sql.end(), what, what + std::strlen(what), [](char a, char b) {
+                return std::toupper((unsigned char)a) == b;
+            });
+            return it != sql.end();
+        }
+
+        int placeholders(const std::string& sql) {
+            int count = 0;
+            for (std::size_t i = 0; i < sql.size(); ++i) {
+                if (sql[i] == '$' && i + 1 < sql.size() && std::isdigit((unsigned char)sql[i + 1])) {
+                    count = std::max(count, std::atoi(sql.c_str() + i + 1));
+                }
+            }
+            return count;
+        }
+
+        // Reads a quoted identifier or string literal starting at pos, doubled quotes are kept once
+        std::string unquote(const std::string& sql, std::size_t& pos) {
+            char quote = sql[pos++];
+            std::string text;
+            while (pos < sql.size()) {
+                char c = sql[pos++];
+                if (c == quote) {
+                    if (pos == sql.size() || sql[pos] != quote) {
+                        break;
+                    }
+                    ++pos;
+                }
+                text += c;
+            }
+            return text;
+        }
+
+        // Channel and payload of LISTEN, UNLISTEN and NOTIFY, channel is "*" for UNLISTEN *
+        void channel_args(const std::string& sql, std::string& channel, std::string& payload) {
+            std::size_t pos = 0;
+            auto skip_spaces = [&] {
+                while (pos < sql.size() && std::isspace((unsigned char)sql[pos])) {
+                    ++pos;
+                }
+            };
+            skip_spaces();
+            while (pos < sql.size() && std::isalpha((unsigned char)sql[pos])) {
+                ++pos;
+            }
+            skip_spaces();
+            if (pos < sql.size() && sql[pos] == '"') {
+                channel = unquote(sql, pos);
+            }
+            else {
+                while (pos < sql.size() && (std::isalnum((unsigned char)sql[pos]) || sql[pos] == '_' || sql[pos] == '*')) {
+                    channel += (char)std::tolower((unsigned char)sql[pos++]);
+                }
+            }
+            skip_spaces();
+            if (pos < sql.size() && sql[pos] == ',') {
+                ++pos;
+                skip_spaces();
+                if (pos < sql.size() && sql[pos] == '\'') {
+                    payload = unquote(sql, pos);
+                }
+            }
+        }
+
+        // Statements of a simple query string, split on ';' outside of quotes
+        std::vector<std::string> split(const std::string& sql) {
+            std::vector<std::string> statements;
+            std::string current;
+            char quote = 0;
+            for(char c: sql) {
+                if (quote) {
+                    quote = c == quote ? 0 : quote;
+                }
+                else if (c == '\'' || c == '"') {
+                    quote = c;
+                }
+                else if (c == ';') {
+                    if (!first_word(current).empty()) {
+                        statements.push_back(current);
+                    }
+                    current.clear();
+                    continue;
+                }
+                current += c;
+            }
+            if (!first_word(current).empty()) {
+                statements.push_back(current);
+            }
+            return statements;
+        }
+    }
+
+    struct server::session {
+        enum class state {
+            startup, password, ready, copy_in, closing
+        };
+
+        struct statement {
+            std::string sql;
+            std::vector<int32_t> types;
+        };
+
+        struct portal {
+            std::string sql;
+            std::vector<int16_t> formats;
+        };
+
+        int fd = -1;
+        state st = state::startup;
+        std::string in;
+        std::size_t in_pos = 0;
+        std::string out;
+        std::size_t out_pos = 0;
+        bool armed_out = false;
+        // Replies which become visible once the statements before them are done
+        std::deque<std::pair<clock::time_point, std::string>> delayed;
+        clock::time_point busy_until;
+        char tx = 'I';
+        bool extended = false;
+        bool skip_until_sync = false;
+        uint64_t copy_rows = 0;
+        std::unordered_map<std::string, statement> statements;
+        std::unordered_map<std::string, portal> portals;
+        int32_t pid = 0;
+        // LISTEN channels
+        std::set<std::string> channels;
+
+        void reply(std::string bytes) {
+            if (delayed.empty() && busy_until <= clock::now()) {
+                out += bytes;
+            }
+            else if (delayed.size() && delayed.back().first >= busy_until) {
+                delayed.back().second += bytes;
+            }
+            else {
+                delayed.emplace_back(busy_until, std::move(bytes));
+            }
+        }
+    };
+
+    server::server(const server_options& options)
+    : _options(options) {}
+
+    server::~server() {
+        stop();
+    }
+
+    void server::start() {
+        _listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_options.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(_listen, (sockaddr*)&addr, sizeof(addr)) == -1 || listen(_listen, 1024) == -1) {
+            std::string error = std::strerror(errno);
+            close(_listen);
+            _listen = -1;
+            throw std::runtime_error("stub server: " + error);
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(_listen, (sockaddr*)&addr, &len);
+        _port = ntohs(addr.sin_port);
+
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        _timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        _wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        for(int fd: {_listen, _timer, _wakeup}) {
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev);
+        }
+        _stop.store(false);
+        _thread = std::thread(&server::run, this);
+    }
+
+    void server::stop() {
+        if (!_thread.joinable()) {
+            return;
+        }
+        _stop.store(true);
+        uint64_t one = 1;
+        write(_wakeup, &one, sizeof(one));
+        _thread.join();
+        for(int fd: {_listen, _timer, _wakeup, _epoll}) {
+            close(fd);
+        }
+        _listen = _timer = _wakeup = _epoll = -1;
+    }
+
+    uint16_t server::port() const {
+        return _port;
+    }
+
+    const server::counters& server::stats() const {
+        return _stats;
+    }
+
+    void server::run() {
+        std::unordered_map<int, std::unique_ptr<session>> sessions;
+        std::mt19937 random(_options.seed);
+        std::uniform_real_distribution<double> chance(0, 1);
+        int32_t next_pid = 1000;
+
+        auto latency = [&]() -> clock::duration {
+            auto jitter = _options.jitter.count();
+            auto us = _options.latency.count();
+            if (jitter > 0) {
+                us += std::uniform_int_distribution<int64_t>(-jitter, jitter)(random);
+            }
+            return std::chrono::microseconds(std::max<int64_t>(0, us));
+        };
+
+        auto close_session = [&](session& s) {
+            epoll_ctl(_epoll, EPOLL_CTL_DEL, s.fd, nullptr);
+            close(s.fd);
+            sessions.erase(s.fd);
+        };
+
+        auto ready_for_query = [](session& s) {
+            s.reply(message('Z').int8(s.tx).done());
+        };
+
+        auto row_description = [&](const std::vector<int16_t>& formats) {
+            auto format = [&formats](std::size_t col) -> int16_t {
+                return formats.empty() ? 0 : formats.size() == 1 ? formats[0] : formats[col];
+            };
+            message m('T');
+            m.int16(2);
+            m.str("id").int32(0).int16(0).int32(oid_int4).int16(4).int32(-1).int16(format(0));
+            m.str("value").int32(0).int16(0).int32(oid_text).int16(-1).int32(-1).int16(format(1));
+            return m.done();
+        };
+
+        auto returns_rows = [](const std::string& sql) {
+            std::string word = first_word(sql);
+            return word == "SELECT" || word == "WITH" || word == "VALUES" || word == "SHOW" ||
+                   contains(sql, "RETURNING");
+        };
+
+        // Runs one statement and queues its replies behind the ones before it.
+        // Returns false if it failed, described is set when RowDescription was
+        // already sent for it by Describe
+        auto execute = [&](session& s, const std::string& sql, const std::vector<int16_t>& formats,
+                           bool described) {
+            _stats.statements.fetch_add(1, std::memory_order_relaxed);
+            s.busy_until = std::max(s.busy_until, clock::now()) + latency();
+            std::string word = first_word(sql);
+
+            if (s.tx == 'E' && word != "ROLLBACK" && word != "COMMIT" && word != "END" && word != "ABORT") {
+                s.reply(error_response("ERROR", "25P02",
+                                       "current transaction is aborted, commands ignored until end of transaction block"));
+                return false;
+            }
+            bool marked = _options.fail_marker.size() && sql.find(_options.fail_marker) != std::string::npos;
+            if (marked || (_options.error_rate > 0 && chance(random) < _options.error_rate)) {
+                _stats.errors.fetch_add(1, std::memory_order_relaxed);
+                s.reply(error_response("ERROR", "XX000", "injected failure"));
+                if (s.tx == 'T') {
+                    s.tx = 'E';
+                }
+                return false;
+            }
+
+            if (word == "COPY" && contains(sql, "FROM STDIN")) {
+                s.reply(message('G').int8(0).int16(0).done());
+                s.st = session::state::copy_in;
+                s.copy_rows = 0;
+                return true;
+            }
+            if (word == "COPY" && contains(sql, "TO STDOUT")) {
+                s.reply(message('H').int8(0).int16(0).done());
+                std::string value(_options.row_bytes, 'x');
+                for (int i = 0; i < _options.rows; ++i) {
+                    std::string line = std::to_string(i + 1) + "\t" + value + "\n";
+                    s.reply(message('d').bytes(line.data(), line.size()).done());
+                }
+                s.reply(message('c').done());
+                s.reply(message('C').str("COPY " + std::to_string(_options.rows)).done());
+                return true;
+            }
+
+            int rows = 0;
+            if (returns_rows(sql)) {
+                rows = _options.rows;
+                if (!described) {
+                    s.reply(row_description(formats));
+                }
+                std::string value(_options.row_bytes, 'x');
+                bool binary_id = !formats.empty() && formats[0] == 1;
+                for (int i = 0; i < rows; ++i) {
+                    message m('D');
+                    m.int16(2);
+                    if (binary_id) {
+                        m.int32(4).int32(i + 1);
+                    }
+                    else {
+                        std::string id = std::to_string(i + 1);
+                        m.int32((int32_t)id.size()).bytes(id.data(), id.size());
+                    }
+                    m.int32((int32_t)value.size()).bytes(value.data(), value.size());
+                    s.reply(m.done());
+                }
+            }
+
+            std::string tag = word;
+            if (word == "SELECT") {
+                tag = "SELECT " + std::to_string(rows);
+            }
+            else if (word == "INSERT") {
+                tag = "INSERT 0 " + std::to_string(std::max(rows, 1));
+            }
+            else if (word == "UPDATE" || word == "DELETE") {
+                tag += " " + std::to_string(std::max(rows, 1));
+            }
+            else if (word == "BEGIN" || word == "START") {
+                tag = "BEGIN";
+                s.tx = 'T';
+            }
+            else if (word == "COMMIT" || word == "END" || word == "ROLLBACK" || word == "ABORT") {
+                tag = s.tx == 'E' || word == "ROLLBACK" || word == "ABORT" ? "ROLLBACK" : "COMMIT";
+                s.tx = 'I';
+            }
+            else if (word == "LISTEN" || word == "UNLISTEN" || word == "NOTIFY") {
+                std::string channel, payload;
+                channel_args(sql, channel, payload);
+                if (word == "LISTEN") {
+                    s.channels.insert(channel);
+                }
+                else if (word == "UNLISTEN" && channel == "*") {
+                    s.channels.clear();
+                }
+                else if (word == "UNLISTEN") {
+                    s.channels.erase(channel);
+                }
+                else {
+                    // delivered at once, also inside a transaction block
+                    s.reply(message('C').str(tag).done());
+                    for(auto& it: sessions) {
+                        if (it.second->channels.count(channel)) {
+                            it.second->reply(message('A').int32(s.pid).str(channel).str(payload).done());
+                        }
+                    }
+                    return true;
+                }
+            }
+            s.reply(message('C').str(tag).done());
+            return true;
+        };
+
+        auto fail_extended = [&](session& s, const char* sqlstate, const std::string& text) {
+            s.reply(error_response("ERROR", sqlstate, text));
+            s.skip_until_sync = true;
+        };
+
+        auto authenticated = [&](session& s) {
+            s.st = session::state::ready;
+            s.reply(message('R').int32(0).done());
+            const char* parameters[][2] = {
+                {"server_version", "15.0"}, {"server_encoding", "UTF8"}, {"client_encoding", "UTF8"},
+                {"DateStyle", "ISO, MDY"}, {"integer_datetimes", "on"}, {"standard_conforming_strings", "on"},
+                {"TimeZone", "UTC"}
+            };
+            for(auto& p: parameters) {
+                s.reply(message('S').str(p[0]).str(p[1]).done());
+            }
+            s.pid = next_pid++;
+            s.reply(message('K').int32(s.pid).int32((int32_t)random()).done());
+            ready_for_query(s);
+        };
+
+        auto startup = [&](session& s, reader& r) {
+            int32_t code = r.int32();
+            if (code == ssl_request || code == gssenc_request) {
+                s.out += 'N';
+                return true;
+            }
+            if (code == cancel_request || code != protocol_v3) {
+                // queries are never cancelled, they finish on their own
+                return false;
+            }
+            while (r.ok()) {
+                std::string key = r.str();
+                if (key.empty()) {
+                    break;
+                }
+                r.str();
+            }
+            if (_options.password.size()) {
+                s.reply(message('R').int32(3).done());
+                s.st = session::state::password;
+            }
+            else {
+                authenticated(s);
+            }
+            return true;
+        };
+
+        // Handles one message, false closes the connection
+        auto handle = [&](session& s, char type, reader& r) {
+            if (s.st == session::state::password) {
+                if (type != 'p' || r.str() != _options.password) {
+                    s.reply(error_response("FATAL", "28P01", "password authentication failed"));
+                    s.st = session::state::closing;
+                    return true;
+                }
+                authenticated(s);
+                return true;
+            }
+
+            if (s.st == session::state::copy_in) {
+                switch (type) {
+                    case 'd': {
+                        std::string data = r.rest();
+                        s.copy_rows += std::count(data.begin(), data.end(), '\n');
+                        return true;
+                    }
+                    case 'c':
+                        s.st = session::state::ready;
+                        s.reply(message('C').str("COPY " + std::to_string(s.copy_rows)).done());
+                        if (!s.extended) {
+                            ready_for_query(s);
+                        }
+                        return true;
+                    case 'f':
+                        s.st = session::state::ready;
+                        s.reply(error_response("ERROR", "57014", "COPY from stdin failed: " + r.str()));
+                        if (s.tx == 'T') {
+                            s.tx = 'E';
+                        }
+                        if (s.extended) {
+                            s.skip_until_sync = true;
+                        }
+                        else {
+                            ready_for_query(s);
+                        }
+                        return true;
+                    case 'H':
+                    case 'S':
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
+            if (type == 'X') {
+                return false;
+            }
+            if (type == 'Q') {
+                s.extended = false;
+                std::string sql = r.str();
+                auto statements = split(sql);
+                if (statements.empty()) {
+                    s.reply(message('I').done());
+                }
+                for(auto& statement: statements) {
+                    if (_options.disconnect_rate > 0 && chance(random) < _options.disconnect_rate) {
+                        _stats.disconnects.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                    if (!execute(s, statement, {}, false)) {
+                        break;
+                    }
+                    if (s.st == session::state::copy_in) {
+                        return true;
+                    }
+                }
+                ready_for_query(s);
+                return true;
+            }
+
+            s.extended = true;
+            if (type == 'S') {
+                s.skip_until_sync = false;
+                s.portals.erase("");
+                ready_for_query(s);
+                return true;
+            }
+            if (type == 'H') {
+                return true;
+            }
+            if (s.skip_until_sync) {
+                return true;
+            }
+
+            switch (type) {
+                case 'P': {
+                    std::string name = r.str();
+                    session::statement statement;
+                    statement.sql = r.str();
+                    int16_t count = r.int16();
+                    for (int i = 0; i < count; ++i) {
+                        statement.types.push_back(r.int32());
+                    }
+                    int total = std::max<int>(count, placeholders(statement.sql));
+                    statement.types.resize(total, 0);
+                    for(auto& t: statement.types) {
+                        t = t ? t : oid_text;
+                    }
+                    if (name.size() && s.statements.count(name)) {
+                        fail_extended(s, "42P05", "prepared statement \"" + name + "\" already exists");
+                        return true;
+                    }
+                    s.statements[name] = std::move(statement);
+                    s.reply(message('1').done());
+                    return true;
+                }
+                case 'B': {
+                    std::string name = r.str();
+                    auto it = s.statements.find(r.str());
+                    if (it == s.statements.end()) {
+                        fail_extended(s, "26000", "prepared statement does not exist");
+                        return true;
+                    }
+                    int16_t formats = r.int16();
+                    r.skip(2 * formats);
+                    int16_t params = r.int16();
+                    for (int i = 0; i < params; ++i) {
+                        int32_t len = r.int32();
+                        r.skip(len > 0 ? len : 0);
+                    }
+                    session::portal p;
+                    p.sql = it->second.sql;
+                    int16_t results = r.int16();
+                    for (int i = 0; i < results; ++i) {
+                        p.formats.push_back(r.int16());
+                    }
+                    if (!r.ok() || params != (int16_t)it->second.types.size()) {
+                        fail_extended(s, "08P01", "bind message supplies " + std::to_string(params) +
+                                      " parameters, but prepared statement requires " +
+                                      std::to_string(it->second.types.size()));
+                        return true;
+                    }
+                    s.portals[name] = std::move(p);
+                    s.reply(message('2').done());
+                    return true;
+                }
+                case 'D': {
+                    char kind = r.int8();
+                    std::string name = r.str();
+                    if (kind == 'S') {
+                        auto it = s.statements.find(name);
+                        if (it == s.statements.end()) {
+                            fail_extended(s, "26000", "prepared statement \"" + name + "\" does not exist");
+                            return true;
+                        }
+                        message m('t');
+                        m.int16((int16_t)it->second.types.size());
+                        for(auto t: it->second.types) {
+                            m.int32(t);
+                        }
+                        s.reply(m.done());
+                        s.reply(returns_rows(it->second.sql) ? row_description({}) : message('n').done());
+                        return true;
+                    }
+                    auto it = s.portals.find(name);
+                    if (it == s.portals.end()) {
+                        fail_extended(s, "34000", "portal \"" + name + "\" does not exist");
+                        return true;
+                    }
+                    s.reply(returns_rows(it->second.sql) ? row_description(it->second.formats) : message('n').done());
+                    return true;
+                }
+                case 'E': {
+                    auto it = s.portals.find(r.str());
+                    if (it == s.portals.end()) {
+                        fail_extended(s, "34000", "portal does not exist");
+                        return true;
+                    }
+                    if (_options.disconnect_rate > 0 && chance(random) < _options.disconnect_rate) {
+                        _stats.disconnects.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                    // libpq always describes the portal before executing it
+                    if (!execute(s, it->second.sql, it->second.formats, true)) {
+                        s.skip_until_sync = true;
+                    }
+                    return true;
+                }
+                case 'C': {
+                    char kind = r.int8();
+                    std::string name = r.str();
+                    if (kind == 'S') {
+                        s.statements.erase(name);
+                    }
+                    else {
+                        s.portals.erase(name);
+                    }
+                    s.reply(message('3').done());
+                    return true;
+                }
+                default:
+                    s.reply(error_response("FATAL", "08P01", std::string("invalid frontend message type ") + type));
+                    s.st = session::state::closing;
+                    return true;
+            }
+        };
+
+        // Parses complete messages out of the input buffer
+        auto process = [&](session& s) {
+            while (s.st != session::state::closing) {
+                std::size_t available = s.in.size() - s.in_pos;
+                const char* data = s.in.data() + s.in_pos;
+                bool typed = s.st != session::state::startup;
+                std::size_t header = typed ? 5 : 4;
+                if (available < header) {
+                    break;
+                }
+                uint32_t len;
+                std::memcpy(&len, data + (typed ? 1 : 0), 4);
+                len = ntohl(len);
+                if (len < 4) {
+                    return false;
+                }
+                std::size_t total = len + (typed ? 1 : 0);
+                if (available < total) {
+                    break;
+                }
+                reader r(data + header, total - header);
+                s.in_pos += total;
+                bool keep = typed ? handle(s, data[0], r) : startup(s, r);
+                if (!keep) {
+                    return false;
+                }
+            }
+            if (s.in_pos > 4096 && s.in_pos * 2 > s.in.size()) {
+                s.in.erase(0, s.in_pos);
+                s.in_pos = 0;
+            }
+            return true;
+        };
+
+        // Sends whatever is due, false if the connection is gone
+        auto send = [&](session& s, clock::time_point now) {
+            while (s.delayed.size() && s.delayed.front().first <= now) {
+                s.out += s.delayed.front().second;
+                s.delayed.pop_front();
+            }
+            while (s.out_pos < s.out.size()) {
+                ssize_t n = ::send(s.fd, s.out.data() + s.out_pos, s.out.size() - s.out_pos, MSG_NOSIGNAL);
+                if (n > 0) {
+                    s.out_pos += n;
+                    continue;
+                }
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                return false;
+            }
+            if (s.out_pos == s.out.size()) {
+                s.out.clear();
+                s.out_pos = 0;
+            }
+            bool want_out = s.out_pos < s.out.size();
+            if (want_out != s.armed_out) {
+                epoll_event ev = {};
+                ev.events = EPOLLIN | (want_out ? (uint32_t)EPOLLOUT : 0u);
+                ev.data.fd = s.fd;
+                epoll_ctl(_epoll, EPOLL_CTL_MOD, s.fd, &ev);
+                s.armed_out = want_out;
+            }
+            return !(s.st == session::state::closing && s.out.empty() && s.delayed.empty());
+        };
+
+        epoll_event events[64];
+        while (!_stop.load()) {
+            // Wake up when the next delayed reply is due
+            clock::time_point next = clock::time_point::max();
+            for(auto& it: sessions) {
+                if (it.second->delayed.size()) {
+                    next = std::min(next, it.second->delayed.front().first);
+                }
+            }
+            itimerspec spec = {};
+            if (next != clock::time_point::max()) {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count();
+                spec.it_value.tv_sec = ns / 1000000000;
+                spec.it_value.tv_nsec = std::max<int64_t>(1, ns % 1000000000);
+            }
+            timerfd_settime(_timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+            int ready = epoll_wait(_epoll, events, 64, -1);
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == _wakeup || fd == _timer) {
+                    uint64_t counter;
+                    read(fd, &counter, sizeof(counter));
+                    continue;
+                }
+                if (fd == _listen) {
+                    int client;
+                    while ((client = accept4(_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                        int one = 1;
+                        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                        std::unique_ptr<session> s(new session());
+                        s->fd = client;
+                        epoll_event ev = {};
+                        ev.events = EPOLLIN;
+                        ev.data.fd = client;
+                        epoll_ctl(_epoll, EPOLL_CTL_ADD, client, &ev);
+                        sessions[client] = std::move(s);
+                        _stats.connections.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    continue;
+                }
+                auto it = sessions.find(fd);
+                if (it == sessions.end()) {
+                    continue;
+                }
+                session& s = *it->second;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    char buf[65536];
+                    bool alive = true;
+                    for (;;) {
+                        ssize_t n = read(fd, buf, sizeof(buf));
+                        if (n > 0) {
+                            s.in.append(buf, n);
+                            continue;
+                        }
+                        alive = n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                        break;
+                    }
+                    if (!process(s) || !alive) {
+                        close_session(s);
+                        continue;
+                    }
+                }
+            }
+
+            clock::time_point now = clock::now();
+            std::vector<session*> gone;
+            for(auto& it: sessions) {
+                if (!send(*it.second, now)) {
+                    gone.push_back(it.second.get());
+                }
+            }
+            for(auto s: gone) {
+                close_session(*s);
+            }
+        }
+
+        for(auto& it: sessions) {
+            close(it.first);
+        }
+    }
+}
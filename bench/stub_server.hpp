@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace stub {
+
+    struct server_options {
+        // 0 picks a free port, see server::port()
+        uint16_t port = 0;
+        // Time every statement takes, uniformly spread by +-jitter.
+        // Statements of one connection run one after another
+        std::chrono::microseconds latency{0};
+        std::chrono::microseconds jitter{0};
+        // Rows returned by a row returning statement, every row is an int4 id
+        // and a text value of row_bytes characters
+        int rows = 1;
+        int row_bytes = 16;
+        // Share of statements failing with an error or closing the connection
+        double error_rate = 0;
+        double disconnect_rate = 0;
+        // Statements containing fail_marker always fail
+        std::string fail_marker = "/* fail */";
+        // Non-empty requires cleartext password authentication
+        std::string password;
+        uint32_t seed = 1;
+    };
+
+    // Single threaded stand-in for a PostgreSQL server which speaks enough of
+    // protocol v3 for libpq: startup with trust or password authentication,
+    // simple and extended query, pipelines, COPY FROM STDIN and TO STDOUT,
+    // LISTEN and NOTIFY.
+    // SQL is not parsed, statements starting with SELECT, WITH, VALUES or SHOW
+    // or containing RETURNING return rows, everything else only a command tag
+    class server {
+    public:
+        explicit server(const server_options& options = server_options());
+        ~server();
+        server(const server&) = delete;
+
+        // Listens on 127.0.0.1 and serves connections on a background thread
+        void start();
+        void stop();
+        uint16_t port() const;
+
+        struct counters {
+            std::atomic<uint64_t> connections{0};
+            std::atomic<uint64_t> statements{0};
+            std::atomic<uint64_t> errors{0};
+            std::atomic<uint64_t> disconnects{0};
+        };
+        const counters& stats() const;
+
+    private:
+        struct session;
+
+        void run();
+
+        server_options _options;
+        counters _stats;
+        int _listen = -1;
+        int _epoll = -1;
+        int _timer = -1;
+        int _wakeup = -1;
+        uint16_t _port = 0;
+        std::atomic<bool> _stop{false};
+        std::thread _thread;
+    };
+}
@@ -0,0 +1,162 @@
+// Contention benchmark of query submission paths: the former mutex + std::list +
+// pipe path of connection_pool::async_query against the mpsc_ring + eventfd path.
+// Needs no database server.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include "../src/db/query.hpp"
+#include "../src/db/mpsc_ring.hpp"
+
+namespace {
+    
+    class mutex_pipe_queue {
+    public:
+        mutex_pipe_queue() {
+            if (pipe(_pipefd) == -1) {
+                std::perror("pipe");
+                std::exit(1);
+            }
+        }
+        ~mutex_pipe_queue() {
+            close(_pipefd[0]);
+            close(_pipefd[1]);
+        }
+        
+        void push(db::query&& q) {
+            std::unique_lock<std::mutex> lock(_mtx);
+            bool empty = _queue.empty();
+            _queue.push_back(std::move(q));
+            lock.unlock();
+            if (empty) {
+                char cmd = '1';
+                write(_pipefd[1], &cmd, 1);
+            }
+        }
+        
+        std::size_t consume() {
+            pollfd pfd = {_pipefd[0], POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) {
+                return 0;
+            }
+            int bytes_available;
+            if (ioctl(_pipefd[0], FIONREAD, &bytes_available) == 0) {
+                for (int i = 0; i < bytes_available; ++i) {
+                    char cmd;
+                    read(_pipefd[0], &cmd, 1);
+                }
+            }
+            std::list<db::query> queries;
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                for(auto& q: _queue) {
+                    queries.push_back(std::move(q));
+                }
+                _queue.clear();
+            }
+            return queries.size();
+        }
+        
+    private:
+        std::mutex _mtx;
+        std::list<db::query> _queue;
+        int _pipefd[2];
+    };
+    
+    class ring_eventfd_queue {
+    public:
+        ring_eventfd_queue(): _ring(1 << 16) {
+            _eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        ~ring_eventfd_queue() {
+            close(_eventfd);
+        }
+        
+        void push(db::query&& q) {
+            while (!_ring.push(std::move(q))) {
+                std::this_thread::yield();
+            }
+            if (!_notified.exchange(true, std::memory_order_acq_rel)) {
+                uint64_t one = 1;
+                write(_eventfd, &one, sizeof(one));
+            }
+        }
+        
+        std::size_t consume() {
+            pollfd pfd = {_eventfd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) {
+                return 0;
+            }
+            uint64_t counter;
+            read(_eventfd, &counter, sizeof(counter));
+            _notified.exchange(false, std::memory_order_acq_rel);
+            std::vector<db::query> queries;
+            queries.reserve(1024);
+            std::size_t count = 0;
+            _ring.drain([&queries, &count](db::query&& q) {
+                queries.push_back(std::move(q));
+                if (queries.size() == 1024) {
+                    count += queries.size();
+                    queries.clear();
+                }
+            });
+            return count + queries.size();
+        }
+        
+    private:
+        db::mpsc_ring<db::query> _ring;
+        std::atomic<bool> _notified{false};
+        int _eventfd;
+    };
+    
+    template <typename Queue>
+    double run(int producers, std::size_t total) {
+        Queue queue;
+        std::size_t per_thread = total / producers;
+        std::size_t expected = per_thread * producers;
+        std::atomic<bool> go{false};
+        
+        std::vector<std::thread> threads;
+        for (int i = 0; i < producers; ++i) {
+            threads.emplace_back([&queue, &go, per_thread] {
+                while (!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                for (std::size_t j = 0; j < per_thread; ++j) {
+                    queue.push(db::query("SELECT 1", nullptr));
+                }
+            });
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        std::size_t consumed = 0;
+        while (consumed < expected) {
+            consumed += queue.consume();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        for(auto& t: threads) {
+            t.join();
+        }
+        return std::chrono::duration<double, std::nano>(elapsed).count() / expected;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    std::size_t total = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+    std::printf("%-10s %18s %18s\n", "producers", "mutex+pipe ns/op", "ring+eventfd ns/op");
+    for (int producers: {1, 2, 4, 8, 20, 64}) {
+        double locked = run<mutex_pipe_queue>(producers, total);
+        double ring = run<ring_eventfd_queue>(producers, total);
+        std::printf("%-10d %18.1f %18.1f\n", producers, locked, ring);
+    }
+    return 0;
+}
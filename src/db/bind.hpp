@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "query.hpp"
+#include "endian.hpp"
+
+namespace db {
+    
+    // Built-in type OIDs, see pg_type.dat
+    namespace oid {
+        constexpr Oid boolean = 16;
+        constexpr Oid bytea = 17;
+        constexpr Oid int8 = 20;
+        constexpr Oid int2 = 21;
+        constexpr Oid int4 = 23;
+        constexpr Oid text = 25;
+        constexpr Oid float4 = 700;
+        constexpr Oid float8 = 701;
+    }
+    
+    // Binary encoding and type OID of a C++ type, chosen at compile time
+    template <typename T, typename Enable = void>
+    struct bind;
+    
+    template <>
+    struct bind<bool> {
+        static constexpr Oid oid = oid::boolean;
+        static query::param encode(bool value) {
+            unsigned char byte = value ? 1 : 0;
+            return query::param::typed(&byte, 1, oid);
+        }
+    };
+    
+    template <typename T>
+    struct bind<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+        // char and unsigned types go to the smallest signed type holding them
+        using wire_t = typename std::conditional<(sizeof(T) < 2 || (sizeof(T) == 2 && std::is_signed<T>::value)), int16_t,
+                       typename std::conditional<(sizeof(T) < 4 || (sizeof(T) == 4 && std::is_signed<T>::value)), int32_t,
+                       int64_t>::type>::type;
+        static constexpr Oid oid = sizeof(wire_t) == 2 ? oid::int2 : sizeof(wire_t) == 4 ? oid::int4 : oid::int8;
+        static query::param encode(T value) {
+            unsigned char data[sizeof(wire_t)];
+            store_be<wire_t>(data, (wire_t)value);
+            return query::param::typed(data, sizeof(data), oid);
+        }
+    };
+    
+    template <>
+    struct bind<float> {
+        static constexpr Oid oid = oid::float4;
+        static query::param encode(float value) {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            unsigned char data[4];
+            store_be(data, bits);
+            return query::param::typed(data, sizeof(data), oid);
+        }
+    };
+    
+    template <>
+    struct bind<double> {
+        static constexpr Oid oid = oid::float8;
+        static query::param encode(double value) {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            unsigned char data[8];
+            store_be(data, bits);
+            return query::param::typed(data, sizeof(data), oid);
+        }
+    };
+    
+    // Binary text is the bytes themselves, without trailing NUL
+    template <>
+    struct bind<std::string_view> {
+        static constexpr Oid oid = oid::text;
+        static query::param encode(std::string_view value) {
+            return query::param::typed(value.data(), value.size(), oid);
+        }
+    };
+    
+    template <>
+    struct bind<std::string>: bind<std::string_view> {};
+    
+    template <>
+    struct bind<const char*>: bind<std::string_view> {};
+    
+    template <typename T>
+    struct bind<std::optional<T>> {
+        static constexpr Oid oid = bind<T>::oid;
+        static query::param encode(const std::optional<T>& value) {
+            return value ? bind<T>::encode(*value) : query::param::null(oid);
+        }
+    };
+    
+    // Highest $N of sql, quoted literals and identifiers are skipped
+    constexpr std::size_t placeholders(const char* sql) {
+        std::size_t count = 0;
+        char quote = 0;
+        for (std::size_t i = 0; sql[i]; ++i) {
+            char c = sql[i];
+            if (quote) {
+                quote = c == quote ? 0 : quote;
+            }
+            else if (c == '\'' || c == '"') {
+                quote = c;
+            }
+            else if (c == '$' && sql[i + 1] >= '0' && sql[i + 1] <= '9') {
+                std::size_t number = 0;
+                while (sql[i + 1] >= '0' && sql[i + 1] <= '9') {
+                    number = number * 10 + (sql[++i] - '0');
+                }
+                count = number > count ? number : count;
+            }
+        }
+        return count;
+    }
+    
+    // Base of the types produced by DB_SQL
+    struct sql_literal {};
+    
+    // SQL text carried in a type, lets make_query check placeholders at compile time
+#define DB_SQL(text) \
+    [] { \
+        struct literal: ::db::sql_literal { \
+            static constexpr const char* value() { return text; } \
+        }; \
+        return literal(); \
+    }()
+    
+    template <typename T>
+    struct identity {
+        using type = T;
+    };
+    
+    // db::make_query<int64_t, std::string_view, bool>(sql, id, name, male, handler)
+    template <typename... T>
+    query make_query(std::string sql, const typename identity<T>::type&... args, query::callback_t handler) {
+        query::params_t params;
+        params.reserve(sizeof...(T));
+        (params.push_back(bind<typename std::decay<T>::type>::encode(args)), ...);
+        return query(std::move(sql), std::move(params), std::move(handler));
+    }
+    
+    // db::make_query<int64_t, bool>(DB_SQL("UPDATE users SET male = $2 WHERE id = $1"), id, male, handler)
+    template <typename... T, typename S,
+              typename = typename std::enable_if<std::is_base_of<sql_literal, S>::value>::type>
+    query make_query(S, const typename identity<T>::type&... args, query::callback_t handler) {
+        static_assert(placeholders(S::value()) == sizeof...(T),
+                      "number of arguments doesn't match $N placeholders");
+        return make_query<T...>(std::string(S::value()), args..., std::move(handler));
+    }
+}
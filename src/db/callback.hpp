@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace db {
+    
+    template <typename Signature, std::size_t Inline = 32>
+    class callback;
+    
+    // Move-only replacement of std::function. Callables up to inline_size bytes
+    // (by default a few captured pointers, a std::function) are kept inside the object,
+    // bigger ones go to the heap
+    template <typename R, typename... Args, std::size_t Inline>
+    class callback<R(Args...), Inline> {
+    public:
+        static constexpr std::size_t inline_size = Inline;
+        
+        callback() = default;
+        callback(std::nullptr_t) {}
+        
+        template <typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, callback>::value &&
+            !std::is_same<typename std::decay<F>::type, std::nullptr_t>::value>::type>
+        callback(F&& f) {
+            using T = typename std::decay<F>::type;
+            if (is_empty(f)) {
+                return;
+            }
+            if constexpr (sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t) &&
+                          std::is_nothrow_move_constructible<T>::value) {
+                new (&_storage) T(std::forward<F>(f));
+                _ops = &inline_ops<T>::table;
+            }
+            else {
+                *reinterpret_cast<T**>(&_storage) = new T(std::forward<F>(f));
+                _ops = &heap_ops<T>::table;
+            }
+        }
+        
+        callback(callback&& other) noexcept {
+            take(other);
+        }
+        callback(const callback&) = delete;
+        
+        ~callback() {
+            reset();
+        }
+        
+        callback& operator=(callback&& other) noexcept {
+            if (this != &other) {
+                reset();
+                take(other);
+            }
+            return *this;
+        }
+        callback& operator=(std::nullptr_t) {
+            reset();
+            return *this;
+        }
+        callback& operator=(const callback&) = delete;
+        
+        explicit operator bool() const {
+            return _ops != nullptr;
+        }
+        
+        R operator()(Args... args) const {
+            return _ops->invoke(&_storage, std::forward<Args>(args)...);
+        }
+        
+    private:
+        using storage_t = typename std::aligned_storage<inline_size, alignof(std::max_align_t)>::type;
+        
+        struct ops {
+            R (*invoke)(void* storage, Args&&... args);
+            void (*move)(void* from, void* to);
+            void (*destroy)(void* storage);
+        };
+        
+        template <typename T>
+        struct inline_ops {
+            static R invoke(void* storage, Args&&... args) {
+                return (*static_cast<T*>(storage))(std::forward<Args>(args)...);
+            }
+            static void move(void* from, void* to) {
+                new (to) T(std::move(*static_cast<T*>(from)));
+                static_cast<T*>(from)->~T();
+            }
+            static void destroy(void* storage) {
+                static_cast<T*>(storage)->~T();
+            }
+            static constexpr ops table = {invoke, move, destroy};
+        };
+        
+        template <typename T>
+        struct heap_ops {
+            static R invoke(void* storage, Args&&... args) {
+                return (**static_cast<T**>(storage))(std::forward<Args>(args)...);
+            }
+            static void move(void* from, void* to) {
+                *static_cast<T**>(to) = *static_cast<T**>(from);
+            }
+            static void destroy(void* storage) {
+                delete *static_cast<T**>(storage);
+            }
+            static constexpr ops table = {invoke, move, destroy};
+        };
+        
+        template <typename T>
+        static bool is_empty(const T& f) {
+            if constexpr (std::is_pointer<T>::value || std::is_member_pointer<T>::value ||
+                          std::is_constructible<bool, const T&>::value) {
+                return !f;
+            }
+            else {
+                return false;
+            }
+        }
+        
+        void take(callback& other) {
+            if (other._ops) {
+                other._ops->move(&other._storage, &_storage);
+                _ops = other._ops;
+                other._ops = nullptr;
+            }
+        }
+        
+        void reset() {
+            if (_ops) {
+                _ops->destroy(&_storage);
+                _ops = nullptr;
+            }
+        }
+        
+        mutable storage_t _storage;
+        const ops* _ops = nullptr;
+    };
+}
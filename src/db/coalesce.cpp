@@ -0,0 +1,160 @@
+#include "coalesce.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <strings.h>
+
+namespace db {
+    
+    // Error the server reported for the statement while the session goes on.
+    // Errors libpq makes up itself, e.g. for a lost connection, have no
+    // SQLSTATE, class 08 and 57P are connection and shutdown failures
+    static bool is_statement_error(const PGresult* r) {
+        const char* state = PQresultErrorField(r, PG_DIAG_SQLSTATE);
+        return state && std::strncmp(state, "08", 2) != 0 && std::strncmp(state, "57P", 3) != 0;
+    }
+    
+    bool is_coalescible(const query& q, std::size_t& tuple_pos) {
+        const std::string& sql = q.sql();
+        std::size_t count = q.params().size();
+        if (!count || q.is_exclusive() || q.is_streaming()) {
+            return false;
+        }
+        
+        std::size_t begin = 0;
+        while (begin < sql.size() && std::isspace((unsigned char)sql[begin])) {
+            ++begin;
+        }
+        if (strncasecmp(sql.c_str() + begin, "INSERT", 6) != 0) {
+            return false;
+        }
+        
+        // tuple has to be the last thing in the statement
+        std::size_t end = sql.size();
+        while (end > begin && (std::isspace((unsigned char)sql[end - 1]) || sql[end - 1] == ';')) {
+            --end;
+        }
+        if (end == begin || sql[end - 1] != ')') {
+            return false;
+        }
+        
+        // walk back to the matching open parenthesis
+        int depth = 0;
+        std::size_t open = end;
+        while (open > begin) {
+            --open;
+            char c = sql[open];
+            if (c == '\'' || c == '"') {
+                return false;
+            }
+            if (c == ')') {
+                ++depth;
+            }
+            else if (c == '(' && --depth == 0) {
+                break;
+            }
+        }
+        if (depth != 0) {
+            return false;
+        }
+        
+        // VALUES keyword right before the tuple
+        std::size_t kw = open;
+        while (kw > begin && std::isspace((unsigned char)sql[kw - 1])) {
+            --kw;
+        }
+        if (kw < begin + 6 || strncasecmp(sql.c_str() + kw - 6, "VALUES", 6) != 0) {
+            return false;
+        }
+        
+        // placeholders only inside the tuple and within the params
+        if (sql.find('$', begin) < open) {
+            return false;
+        }
+        for (std::size_t i = open; i < end; ++i) {
+            if (sql[i] != '$') {
+                continue;
+            }
+            if (i + 1 >= end || !std::isdigit((unsigned char)sql[i + 1])) {
+                return false;
+            }
+            std::size_t number = std::strtoul(sql.c_str() + i + 1, nullptr, 10);
+            if (number == 0 || number > count) {
+                return false;
+            }
+        }
+        
+        tuple_pos = open;
+        return true;
+    }
+    
+    query coalesce(std::vector<query>&& batch, std::size_t tuple_pos,
+                   std::function<void(std::vector<query>&&)> on_error) {
+        const std::string& sql = batch.front().sql();
+        std::size_t end = sql.rfind(')') + 1;
+        std::size_t count = batch.front().params().size();
+        
+        std::string merged(sql, 0, tuple_pos);
+        query::params_t params;
+        params.reserve(count * batch.size());
+        for (std::size_t row = 0; row < batch.size(); ++row) {
+            if (row) {
+                merged += ", ";
+            }
+            // renumber $N of the row
+            for (std::size_t i = tuple_pos; i < end; ++i) {
+                merged += sql[i];
+                if (sql[i] == '$') {
+                    char* next;
+                    std::size_t number = std::strtoul(sql.c_str() + i + 1, &next, 10);
+                    merged += std::to_string(number + row * count);
+                    i = next - sql.c_str() - 1;
+                }
+            }
+            for(auto& p: batch[row].params()) {
+                params.push_back(p);
+            }
+        }
+        
+        // merged query waited as long as its oldest row
+        auto enqueued = batch.front().enqueued();
+        for(auto& q: batch) {
+            enqueued = std::min(enqueued, q.enqueued());
+        }
+        auto originals = std::make_shared<std::vector<query>>(std::move(batch));
+        query command(std::move(merged), std::move(params), [originals, on_error = std::move(on_error)](std::list<PGresult*> results) {
+            bool failed = false;
+            bool rejected = true;
+            for(auto r: results) {
+                ExecStatusType status = PQresultStatus(r);
+                if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+                    failed = true;
+                    rejected = rejected && is_statement_error(r);
+                }
+                PQclear(r);
+            }
+            
+            if (results.empty() || (failed && !rejected)) {
+                // not executed, or the connection was lost and the rows may be
+                // committed already, running them again could insert them twice
+                for(auto& q: *originals) {
+                    q.call_handler({});
+                }
+            }
+            else if (failed) {
+                // the server rolled the statement back, find out which row is guilty
+                on_error(std::move(*originals));
+            }
+            else {
+                // without a command tag, see pool_options::coalesce
+                for(auto& q: *originals) {
+                    q.call_handler({PQmakeEmptyPGresult(nullptr, PGRES_COMMAND_OK)});
+                }
+            }
+        });
+        command.schedule(originals->front().priority(), originals->front().tag());
+        command.set_enqueued(enqueued);
+        return command;
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "query.hpp"
+
+namespace db {
+    
+    // Finds the VALUES tuple of "INSERT ... VALUES (...)" whose tuple uses only
+    // $N placeholders of the query params. False if query cannot be merged with others
+    bool is_coalescible(const query& q, std::size_t& tuple_pos);
+    
+    // Merges queries with the same coalescible SQL into one multi row INSERT.
+    // Every original handler gets its own empty PGRES_COMMAND_OK result. If the
+    // merged statement fails the originals are passed to on_error to be executed
+    // one by one
+    query coalesce(std::vector<query>&& batch, std::size_t tuple_pos,
+                   std::function<void(std::vector<query>&&)> on_error);
+}
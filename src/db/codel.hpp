@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+namespace db {
+    
+    // Controlled delay (RFC 8289) on a query queue. Once queries have waited
+    // longer than target for a whole interval, queries are dropped at the head
+    // with drops coming faster (interval / sqrt(n)) until the wait is back below target
+    class codel {
+    public:
+        using clock = std::chrono::steady_clock;
+        
+        codel(clock::duration target, clock::duration interval)
+        : _target(target), _interval(interval) {}
+        
+        bool enabled() const {
+            return _target.count() > 0;
+        }
+        
+        // Called for every dequeued query, true if it has to be dropped
+        bool drop(clock::time_point enqueued, clock::time_point now, bool empty) {
+            bool above = sojourn_above(now - enqueued, now, empty);
+            if (_dropping) {
+                if (!above) {
+                    _dropping = false;
+                    return false;
+                }
+                if (now >= _drop_next) {
+                    ++_count;
+                    _drop_next = control_law(_drop_next);
+                    return true;
+                }
+                return false;
+            }
+            if (above) {
+                _dropping = true;
+                // Resume at the previous drop rate if the last episode was recent
+                _count = (_count > 2 && now - _drop_next < 16 * _interval) ? _count - 2 : 1;
+                _drop_next = control_law(now);
+                return true;
+            }
+            return false;
+        }
+        
+    private:
+        bool sojourn_above(clock::duration sojourn, clock::time_point now, bool empty) {
+            if (sojourn < _target || empty) {
+                _first_above = clock::time_point();
+                return false;
+            }
+            if (_first_above == clock::time_point()) {
+                _first_above = now + _interval;
+                return false;
+            }
+            return now >= _first_above;
+        }
+        
+        clock::time_point control_law(clock::time_point t) const {
+            return t + std::chrono::duration_cast<clock::duration>(_interval / std::sqrt((double)_count));
+        }
+        
+        clock::duration _target;
+        clock::duration _interval;
+        clock::time_point _first_above;
+        clock::time_point _drop_next;
+        uint32_t _count = 0;
+        bool _dropping = false;
+    };
+}
@@ -1,11 +1,16 @@
 #include "connection.hpp"
+#include "poller.hpp"
 #include "../logger/logger.hpp"
 #include <new>
 #include <ios>
+#include <vector>
 
 namespace db {
 
-    std::vector<connection> connection::create(int count, const connect_param_t &params) {
+    std::vector<connection> connection::create(int count, const connect_param_t &params,
+                                               int pipeline_depth, std::size_t statements,
+                                               statement_cache::counters* stats, int first_id,
+                                               metrics* metrics) {
         char** keywords = new char*[params.size() + 1];
         char** values = new char*[params.size() + 1];
         int idx = 0;
@@ -30,7 +35,7 @@ namespace db {
                 delete[] values;
                 throw std::ios_base::failure(error);
             }
-            list.push_back(connection(conn, i));
+            list.push_back(connection(conn, first_id + i, pipeline_depth, statement_cache(statements, stats), metrics));
         }
         
         delete[] keywords;
@@ -38,26 +43,70 @@ namespace db {
         return list;
     }
 
-    connection::connection(PGconn* conn, int id) {
+    connection::connection(PGconn* conn, int id, int pipeline_depth, statement_cache&& statements, metrics* stats)
+    : _statements(std::move(statements)) {
         _conn = conn;
         _id = id;
+        _pipeline_depth = pipeline_depth;
+        _last_used = std::chrono::steady_clock::now();
+        _metrics = stats;
         PQsetnonblocking(_conn, 1);
     }
 
-    connection::connection(connection&& other) {
+    connection::connection(connection&& other)
+    : _statements(std::move(other._statements)) {
         _conn = other._conn;
         _id = other._id;
+        _command = std::move(other._command);
+        _step = other._step;
+        _statement = std::move(other._statement);
+        _evicted = std::move(other._evicted);
+        _copy = std::move(other._copy);
+        _sink = std::move(other._sink);
+        _copy_chunk = std::move(other._copy_chunk);
+        _copy_started = other._copy_started;
+        _copy_ended = other._copy_ended;
+        _is_busy = other._is_busy;
+        _need_flush = other._need_flush;
+        _notifies = other._notifies;
+        _polling = other._polling;
+        _fd = other._fd;
+        _armed = other._armed;
+        _last_used = other._last_used;
+        _metrics = other._metrics;
+        _sent = other._sent;
+        _awaiting_response = other._awaiting_response;
+        _transaction = std::move(other._transaction);
+        _tx_step = other._tx_step;
+        _tx_steps = other._tx_steps;
+        _tx_done = other._tx_done;
+        _tx_failed = other._tx_failed;
+        _tx_rollback = other._tx_rollback;
+        _pipeline_depth = other._pipeline_depth;
+        _inflight = std::move(other._inflight);
+        _results = std::move(other._results);
+        _await_sync = other._await_sync;
         other._conn = nullptr;
     }
 
     connection::~connection() {
+        for(auto r: _results) {
+            PQclear(r);
+        }
         if (_conn) {
             PQfinish(_conn);
         }
     }
 
     PostgresPollingStatusType connection::status() {
-        return PQconnectPoll(_conn);
+        _polling = PQconnectPoll(_conn);
+        if (_polling == PGRES_POLLING_OK && _pipeline_depth > 0 &&
+            PQpipelineStatus(_conn) == PQ_PIPELINE_OFF) {
+            if (!PQenterPipelineMode(_conn)) {
+                log_error("[db] pool[%d] enter pipeline mode failed: %s", _id, error());
+            }
+        }
+        return _polling;
     }
 
     const char* connection::error() {
@@ -72,47 +121,191 @@ namespace db {
         return _is_busy;
     }
     
+    bool connection::is_connected() const {
+        return _polling == PGRES_POLLING_OK;
+    }
+    
+    std::size_t connection::in_flight() const {
+        if (_pipeline_depth > 0) {
+            return _inflight.size();
+        }
+        return _is_busy ? 1 : 0;
+    }
+    
+    bool connection::can_execute() const {
+        if (_copy || _sink || _transaction) {
+            return false;
+        }
+        if (_pipeline_depth > 0) {
+            return (int)_inflight.size() < _pipeline_depth;
+        }
+        return !_is_busy;
+    }
+    
     int connection::socket() {
         return PQsocket(_conn);
     }
     
+    const statement_cache& connection::statements() const {
+        return _statements;
+    }
+    
     bool connection::reset() {
-        return PQresetStart(_conn);
+        // query in flight is lost together with the old socket
+        abort_transaction();
+        _command.call_handler({});
+        _copy.reset();
+        _sink.reset();
+        _copy_chunk.clear();
+        for(auto& p: _inflight) {
+            p.command.call_handler({});
+        }
+        _inflight.clear();
+        for(auto r: _results) {
+            PQclear(r);
+        }
+        _results.clear();
+        _await_sync = false;
+        _is_busy = false;
+        _need_flush = false;
+        _awaiting_response = false;
+        if (_metrics) {
+            _metrics->resets.fetch_add(1, std::memory_order_relaxed);
+        }
+        // prepared statements die with the server session
+        _statements.clear();
+        // After PQresetStart, poll as if PQconnectPoll returned PGRES_POLLING_WRITING
+        _polling = PGRES_POLLING_WRITING;
+        if (!PQresetStart(_conn)) {
+            _polling = PGRES_POLLING_FAILED;
+            return false;
+        }
+        return true;
     }
-
-    bool connection::execute(query&& command) {
-        _command = std::move(command);
+    
+    static bool has_error(const std::list<PGresult*>& results) {
+        for(auto r: results) {
+            ExecStatusType status = PQresultStatus(r);
+            if (status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static bool has_rows(const PGresult* res) {
+        ExecStatusType status = PQresultStatus(res);
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        if (status == PGRES_TUPLES_CHUNK) {
+            return true;
+        }
+#endif
+        // complete result means libpq could not switch to row mode
+        return status == PGRES_SINGLE_TUPLE || (status == PGRES_TUPLES_OK && PQntuples(res) > 0);
+    }
+    
+    bool connection::set_row_mode(const query& command) {
+        int retval;
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        if (command.chunk_rows() > 1) {
+            retval = PQsetChunkedRowsMode(_conn, command.chunk_rows());
+        }
+        else
+#else
+        (void)command;
+#endif
+        retval = PQsetSingleRowMode(_conn);
+        return retval == 1;
+    }
+    
+    static void clear_results(std::list<PGresult*>& results) {
+        for(auto r: results) {
+            PQclear(r);
+        }
+        results.clear();
+    }
+    
+    bool connection::cacheable(const query& command) const {
+        // PQsendQuery allows several statements in one string, prepared statements don't
+        return _statements.enabled() && (_pipeline_depth > 0 || command.params().size());
+    }
+    
+    const std::string& connection::statement_key(const query& command) {
+        // Statements are prepared with the param types, the same SQL may come with others
+        _key.assign(command.sql());
+        _key += '\0';
+        for(auto& p: command.params()) {
+            Oid oid = p.oid();
+            _key.append((const char*)&oid, sizeof(oid));
+            _key += p.is_binary() ? 'b' : 't';
+        }
+        return _key;
+    }
+    
+    connection::step connection::lookup(const query& command, std::string& statement, std::string& evicted) {
+        statement.clear();
+        evicted.clear();
+        if (!cacheable(command)) {
+            return step::execute;
+        }
+        const std::string& key = statement_key(command);
+        if (auto name = _statements.find(key)) {
+            statement = *name;
+            return step::execute;
+        }
+        statement = _statements.insert(key, evicted);
+        return evicted.empty() ? step::prepare : step::deallocate;
+    }
+    
+    int connection::send(step s, const query& command, const std::string& statement, const std::string& evicted) {
         int retval = 0;
-        if (_command.params().size()) {
-            char** values = new char*[_command.params().size()];
-            int* lengths = new int[_command.params().size()];
-            int* formats = new int[_command.params().size()];
-            int i = 0;
-            for(auto& p: _command.params()) {
-                values[i] = (char*)p.data();
-                lengths[i] = (int)p.len();
-                formats[i] = (int)p.is_binary();
-                ++i;
+        std::size_t count = command.params().size();
+        
+        if (s == step::deallocate) {
+            std::string sql = "DEALLOCATE " + evicted;
+            for(int attempt = 1; attempt < 5; ++attempt) {
+                retval = PQsendQueryParams(_conn, sql.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 0);
+                if (retval == 1) {
+                    break;
+                }
+                else {
+                    log_error("[db] pool[%d] send deallocate failed: %s", _id, error());
+                }
             }
-            
+            return retval;
+        }
+        
+        // Arrays are reused by every send of this loop thread
+        static thread_local std::vector<const char*> values;
+        static thread_local std::vector<int> lengths;
+        static thread_local std::vector<int> formats;
+        static thread_local std::vector<Oid> types;
+        types.clear();
+        bool typed = false;
+        for(auto& p: command.params()) {
+            types.push_back(p.oid());
+            typed = typed || p.oid();
+        }
+        
+        if (s == step::prepare) {
             for(int attempt = 1; attempt < 5; ++attempt) {
-                retval = PQsendQueryParams(_conn, _command.sql().c_str(),
-                                           (int)_command.params().size(),
-                                           nullptr, values, lengths, formats, 0);
+                retval = PQsendPrepare(_conn, statement.c_str(), command.sql().c_str(), (int)count,
+                                       typed ? types.data() : nullptr);
                 if (retval == 1) {
                     break;
                 }
                 else {
-                    log_error("[db] pool[%d] sendQueryParams failed: %s", _id, error());
+                    log_error("[db] pool[%d] sendPrepare failed: %s", _id, error());
                 }
             }
-            delete[] values;
-            delete[] lengths;
-            delete[] formats;
+            return retval;
         }
-        else {
+        
+        // Simple query protocol always returns text
+        int format = command.is_binary_results() ? 1 : 0;
+        if (!count && PQpipelineStatus(_conn) == PQ_PIPELINE_OFF && !format) {
             for (int attempt = 1; attempt < 5; ++attempt) {
-                retval = PQsendQuery(_conn, _command.sql().c_str());
+                retval = PQsendQuery(_conn, command.sql().c_str());
                 if (retval == 1) {
                     break;
                 }
@@ -120,9 +313,68 @@ namespace db {
                     log_error("[db] pool[%d] sendQuery failed: %s", _id, error());
                 }
             }
+            return retval;
+        }
+        
+        values.clear();
+        lengths.clear();
+        formats.clear();
+        for(auto& p: command.params()) {
+            values.push_back((const char*)p.data());
+            lengths.push_back((int)p.len());
+            formats.push_back((int)p.is_binary());
+        }
+        
+        for(int attempt = 1; attempt < 5; ++attempt) {
+            if (statement.size()) {
+                retval = PQsendQueryPrepared(_conn, statement.c_str(), (int)count,
+                                             values.data(), lengths.data(), formats.data(), format);
+            }
+            else {
+                retval = PQsendQueryParams(_conn, command.sql().c_str(), (int)count,
+                                           typed ? types.data() : nullptr,
+                                           values.data(), lengths.data(), formats.data(), format);
+            }
+            if (retval == 1) {
+                break;
+            }
+            else {
+                log_error("[db] pool[%d] sendQueryParams failed: %s", _id, error());
+            }
+        }
+        return retval;
+    }
+    
+    bool connection::execute(query&& command) {
+        _last_used = std::chrono::steady_clock::now();
+        if (!_is_busy) {
+            _sent = _last_used;
+            _awaiting_response = true;
+        }
+        if (command.transaction()) {
+            return execute_transaction(std::move(command));
+        }
+        if (command.is_copy()) {
+            return execute_copy(std::move(command));
+        }
+        if (_pipeline_depth > 0) {
+            return execute_pipelined(std::move(command));
+        }
+        _command = std::move(command);
+        _step = lookup(_command, _statement, _evicted);
+        int retval = send(_step, _command, _statement, _evicted);
+        // Outside of pipeline row mode must be set right after the query is sent
+        if (retval && _step == step::execute && _command.is_streaming() && !set_row_mode(_command)) {
+            log_error("[db] pool[%d] failed to set row mode", _id);
         }
         _is_busy = retval;
         _need_flush = _is_busy;
+        if (!_is_busy) {
+            if (_step != step::execute) {
+                _statements.erase(statement_key(_command), _statement);
+            }
+            _command.call_handler({});
+        }
         return _is_busy;
     }
 
@@ -132,6 +384,23 @@ namespace db {
             return;
         }
         
+        if (_awaiting_response) {
+            _awaiting_response = false;
+            if (_metrics) {
+                _metrics->first_byte.record(std::chrono::steady_clock::now() - _sent);
+            }
+        }
+        
+        if (_transaction) {
+            consume_transaction();
+            return;
+        }
+        
+        if (_pipeline_depth > 0 && !is_copying()) {
+            consume_pipelined();
+            return;
+        }
+        
         if (PQconsumeInput(_conn)) {
             flush();
         }
@@ -139,22 +408,474 @@ namespace db {
             log_error("[db] pool[%d] consume failed: %s", _id, PQerrorMessage(_conn));
         }
         
-        if (PQisBusy(_conn)) {
+        if (_sink && _copy_started && !_copy_ended && !read_copy_out()) {
             return;
         }
         
-        std::list<PGresult*> results;
+        if (_copy && _copy_started && !_copy_ended) {
+            // Server may end copy with an error at any time, otherwise
+            // PQgetResult keeps returning PGRES_COPY_IN
+            PGresult* res = PQgetResult(_conn);
+            if (res && PQresultStatus(res) == PGRES_COPY_IN) {
+                PQclear(res);
+                copy_data();
+                if (!_copy_ended) {
+                    return;
+                }
+            }
+            else {
+                _copy_ended = true;
+                if (res) {
+                    _results.push_back(res);
+                }
+            }
+        }
+        
+        // Results are taken one by one, streaming query gets a row chunk per result
         while (true) {
+            if (PQisBusy(_conn)) {
+                return;
+            }
             PGresult* res = PQgetResult(_conn);
             if (!res) {
                 break;
             }
-            results.push_back(res);
+            if (_copy && PQresultStatus(res) == PGRES_COPY_IN) {
+                PQclear(res);
+                _copy_started = true;
+                copy_data();
+                if (!_copy_ended) {
+                    return;
+                }
+                continue;
+            }
+            if (_sink && PQresultStatus(res) == PGRES_COPY_OUT) {
+                PQclear(res);
+                _copy_started = true;
+                if (!read_copy_out()) {
+                    return;
+                }
+                continue;
+            }
+            if (_step == step::execute && _command.is_streaming() && has_rows(res)) {
+                _command.call_rows(res);
+                PQclear(res);
+                continue;
+            }
+            _results.push_back(res);
         }
-        _command.call_handler(results);
+        
+        // Move on to the next step of a prepared statement
+        if (_step != step::execute) {
+            bool failed = _step == step::prepare && has_error(_results);
+            if (failed) {
+                _statements.erase(statement_key(_command), _statement);
+            }
+            else {
+                clear_results(_results);
+                _step = _step == step::deallocate ? step::prepare : step::execute;
+                if (send(_step, _command, _statement, _evicted)) {
+                    if (_step == step::execute && _command.is_streaming() && !set_row_mode(_command)) {
+                        log_error("[db] pool[%d] failed to set row mode", _id);
+                    }
+                    _need_flush = true;
+                    return;
+                }
+                _statements.erase(statement_key(_command), _statement);
+            }
+        }
+        
+        std::list<PGresult*> results;
+        results.swap(_results);
+        _copy.reset();
+        _sink.reset();
+        _command.call_handler(std::move(results));
         _is_busy = false;
     }
     
+    bool connection::execute_copy(query&& command) {
+        // COPY is not allowed in pipeline mode, connection leaves it while
+        // copying and status() enters it again afterwards
+        if (PQpipelineStatus(_conn) != PQ_PIPELINE_OFF && !PQexitPipelineMode(_conn)) {
+            log_error("[db] pool[%d] exit pipeline mode failed: %s", _id, error());
+            command.call_handler({});
+            return false;
+        }
+        
+        _command = std::move(command);
+        _step = step::execute;
+        _statement.clear();
+        int retval = 0;
+        for (int attempt = 1; attempt < 5; ++attempt) {
+            retval = PQsendQuery(_conn, _command.sql().c_str());
+            if (retval == 1) {
+                break;
+            }
+            else {
+                log_error("[db] pool[%d] sendQuery failed: %s", _id, error());
+            }
+        }
+        _is_busy = retval;
+        _need_flush = _is_busy;
+        if (!_is_busy) {
+            _command.call_handler({});
+            return false;
+        }
+        _copy = _command.copy();
+        _sink = _command.sink();
+        _copy_chunk.clear();
+        _copy_started = false;
+        _copy_ended = false;
+        return true;
+    }
+    
+    bool connection::execute_transaction(query&& command) {
+        // Statements are pipelined with a single sync point at the end,
+        // connections without pipeline mode enter it for the transaction
+        _command = std::move(command);
+        _transaction = _command.transaction();
+        _step = step::execute;
+        _statement.clear();
+        _tx_step = 0;
+        _tx_steps = 0;
+        _tx_done = 0;
+        _tx_failed = false;
+        _tx_rollback = false;
+        if (PQpipelineStatus(_conn) == PQ_PIPELINE_OFF && !PQenterPipelineMode(_conn)) {
+            log_error("[db] pool[%d] enter pipeline mode failed: %s", _id, error());
+            abort_transaction();
+            _command.call_handler({});
+            return false;
+        }
+        
+        // Prepared statements are not used inside transactions
+        static const std::string unnamed;
+        query commit("COMMIT", nullptr);
+        int retval = send(step::execute, _command, unnamed, unnamed);
+        _tx_steps = retval == 1;
+        for (std::size_t i = 0; retval == 1 && i < _transaction->size(); ++i) {
+            retval = send(step::execute, _transaction->statements()[i], unnamed, unnamed);
+            _tx_steps += retval == 1;
+        }
+        if (retval == 1) {
+            retval = send(step::execute, commit, unnamed, unnamed);
+            _tx_steps += retval == 1;
+        }
+        if (!retval) {
+            // the rest is not sent, what was is rolled back after the sync
+            log_error("[db] pool[%d] transaction send failed: %s", _id, error());
+            _transaction->fail("failed to send the transaction");
+            _tx_failed = true;
+        }
+        if (!PQpipelineSync(_conn)) {
+            log_error("[db] pool[%d] pipeline sync failed: %s", _id, error());
+            abort_transaction();
+            _command.call_handler({});
+            return false;
+        }
+        _is_busy = true;
+        _need_flush = true;
+        return true;
+    }
+    
+    void connection::consume_transaction() {
+        
+        if (PQconsumeInput(_conn)) {
+            flush();
+        }
+        else {
+            log_error("[db] pool[%d] consume failed: %s", _id, PQerrorMessage(_conn));
+        }
+        
+        while (_transaction) {
+            if (PQisBusy(_conn)) {
+                break;
+            }
+            PGresult* res = PQgetResult(_conn);
+            if (!res) {
+                if (_tx_step < _tx_steps) {
+                    finish_transaction_step();
+                    continue;
+                }
+                break;
+            }
+            
+            ExecStatusType status = PQresultStatus(res);
+            if (status == PGRES_PIPELINE_SYNC) {
+                PQclear(res);
+                if (_tx_failed && !_tx_rollback) {
+                    // failed transaction block stays open until it is rolled back
+                    query rollback("ROLLBACK", nullptr);
+                    static const std::string unnamed;
+                    _tx_rollback = true;
+                    if (send(step::execute, rollback, unnamed, unnamed) && PQpipelineSync(_conn)) {
+                        ++_tx_steps;
+                        _need_flush = true;
+                        continue;
+                    }
+                    log_error("[db] pool[%d] rollback failed: %s", _id, error());
+                }
+                if (_pipeline_depth == 0 && !PQexitPipelineMode(_conn)) {
+                    log_error("[db] pool[%d] exit pipeline mode failed: %s", _id, error());
+                }
+                abort_transaction();
+                _is_busy = false;
+                _command.call_handler({PQmakeEmptyPGresult(nullptr, _tx_failed ? PGRES_FATAL_ERROR : PGRES_COMMAND_OK)});
+                return;
+            }
+            if ((status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE) && !_tx_failed) {
+                _tx_failed = true;
+                _transaction->fail(PQresultErrorMessage(res));
+            }
+            _results.push_back(res);
+        }
+        
+        if (_transaction && PQstatus(_conn) == CONNECTION_BAD) {
+            // no more results will arrive
+            _transaction->fail(PQerrorMessage(_conn));
+            abort_transaction();
+            _is_busy = false;
+            _command.call_handler({});
+        }
+    }
+    
+    void connection::finish_transaction_step() {
+        std::list<PGresult*> results;
+        results.swap(_results);
+        // step 0 is BEGIN, then the statements, COMMIT and ROLLBACK
+        std::size_t statement = _tx_step++;
+        bool rollback = _tx_rollback && _tx_step == _tx_steps;
+        if (!rollback && statement >= 1 && statement <= _transaction->size()) {
+            _transaction->statements()[statement - 1].call_handler(std::move(results));
+            _tx_done = statement;
+        }
+        else {
+            clear_results(results);
+        }
+    }
+    
+    void connection::abort_transaction() {
+        if (!_transaction) {
+            return;
+        }
+        clear_results(_results);
+        for (std::size_t i = _tx_done; i < _transaction->size(); ++i) {
+            _transaction->statements()[i].call_handler({});
+        }
+        _transaction.reset();
+    }
+    
+    bool connection::is_copying() const {
+        return _copy || _sink;
+    }
+    
+    bool connection::read_copy_out() {
+        while (true) {
+            char* buffer = nullptr;
+            int len = PQgetCopyData(_conn, &buffer, 1);
+            if (len > 0) {
+                // passed to the sink straight from libpq buffer
+                _sink->write(buffer, len);
+                PQfreemem(buffer);
+                continue;
+            }
+            if (len == 0) {
+                // wait for more data
+                return false;
+            }
+            if (len == -2) {
+                log_error("[db] pool[%d] getCopyData failed: %s", _id, error());
+            }
+            // results tell how copy ended
+            _copy_ended = true;
+            return true;
+        }
+    }
+    
+    void connection::copy_data() {
+        if (!_copy || !_copy_started || _copy_ended) {
+            return;
+        }
+        
+        while (true) {
+            if (_copy_chunk.empty() && !_copy->pop(_copy_chunk)) {
+                if (!_copy->is_finished()) {
+                    // wait for producers
+                    break;
+                }
+                int ret = PQputCopyEnd(_conn, _copy->error());
+                if (ret == 1) {
+                    _copy_ended = true;
+                    _need_flush = true;
+                }
+                else if (ret == -1) {
+                    log_error("[db] pool[%d] putCopyEnd failed: %s", _id, error());
+                    _copy_ended = true;
+                }
+                else {
+                    // wait for write readiness
+                    _need_flush = true;
+                }
+                break;
+            }
+            
+            int ret = PQputCopyData(_conn, _copy_chunk.data(), (int)_copy_chunk.size());
+            if (ret == 1) {
+                _copy_chunk.clear();
+                _need_flush = true;
+            }
+            else if (ret == 0) {
+                // output buffer is full, wait for write readiness
+                _need_flush = true;
+                break;
+            }
+            else {
+                // server has already ended copy, results tell why
+                log_error("[db] pool[%d] putCopyData failed: %s", _id, error());
+                _copy_chunk.clear();
+                _copy_ended = true;
+                break;
+            }
+        }
+        flush();
+    }
+    
+    bool connection::execute_pipelined(query&& command) {
+        // Every query is followed by its own sync point, so an error aborts
+        // only that query and not the rest of the pipeline
+        pipelined p;
+        std::string evicted;
+        step first = lookup(command, p.statement, evicted);
+        p.prepare = first != step::execute;
+        
+        int retval = 1;
+        if (first == step::deallocate) {
+            // separate sync point, failed deallocate must not abort the query
+            retval = send(step::deallocate, command, p.statement, evicted);
+            if (retval == 1 && PQpipelineSync(_conn)) {
+                pipelined internal;
+                internal.internal = true;
+                _inflight.push_back(std::move(internal));
+            }
+            else {
+                retval = 0;
+            }
+        }
+        if (retval == 1 && p.prepare) {
+            retval = send(step::prepare, command, p.statement, evicted);
+        }
+        if (retval == 1) {
+            retval = send(step::execute, command, p.statement, evicted);
+        }
+        if (retval == 1 && !PQpipelineSync(_conn)) {
+            retval = 0;
+        }
+        
+        if (!retval) {
+            log_error("[db] pool[%d] pipeline send failed: %s", _id, error());
+            if (p.prepare) {
+                _statements.erase(statement_key(command), p.statement);
+            }
+            command.call_handler({});
+            _is_busy = !_inflight.empty();
+            _need_flush = _is_busy;
+            return false;
+        }
+        
+        p.command = std::move(command);
+        _inflight.push_back(std::move(p));
+        _is_busy = true;
+        _need_flush = true;
+        return true;
+    }
+    
+    void connection::consume_pipelined() {
+        
+        if (PQconsumeInput(_conn)) {
+            flush();
+        }
+        else {
+            log_error("[db] pool[%d] consume failed: %s", _id, PQerrorMessage(_conn));
+        }
+        
+        while (_inflight.size()) {
+            pipelined& front = _inflight.front();
+            bool rows = !front.internal && !front.prepare && front.command.is_streaming();
+            if (rows && !front.row_mode && !_await_sync) {
+                // In pipeline row mode can only be set once the query is
+                // at the head of the queue, retried until its first result
+                front.row_mode = set_row_mode(front.command);
+            }
+            if (PQisBusy(_conn)) {
+                break;
+            }
+            PGresult* res = PQgetResult(_conn);
+            if (!res) {
+                if (_await_sync) {
+                    // nothing more to read yet
+                    break;
+                }
+                if (front.internal) {
+                    clear_results(_results);
+                    _await_sync = true;
+                }
+                else if (front.prepare) {
+                    // keep prepare error, it is reported instead of the aborted query
+                    front.prepare = false;
+                    front.failed = has_error(_results);
+                    if (front.failed) {
+                        _statements.erase(statement_key(front.command), front.statement);
+                    }
+                    else {
+                        clear_results(_results);
+                    }
+                }
+                else {
+                    // end of results of the front query
+                    front.command.call_handler(std::move(_results));
+                    _results.clear();
+                    _await_sync = true;
+                }
+                continue;
+            }
+            
+            ExecStatusType status = PQresultStatus(res);
+            if (status == PGRES_PIPELINE_SYNC) {
+                PQclear(res);
+                _inflight.pop_front();
+                _await_sync = false;
+                continue;
+            }
+            if (status == PGRES_PIPELINE_ABORTED && front.failed) {
+                PQclear(res);
+                continue;
+            }
+            if (rows) {
+                front.row_mode = true;
+                if (has_rows(res)) {
+                    front.command.call_rows(res);
+                    PQclear(res);
+                    continue;
+                }
+            }
+            _results.push_back(res);
+        }
+        
+        if (PQstatus(_conn) == CONNECTION_BAD) {
+            // no more results will arrive for the rest of the pipeline
+            for(auto& p: _inflight) {
+                if (!p.internal) {
+                    p.command.call_handler(std::move(_results));
+                    _results.clear();
+                }
+            }
+            clear_results(_results);
+            _inflight.clear();
+            _await_sync = false;
+        }
+        _is_busy = !_inflight.empty();
+    }
+    
     void connection::flush() {
         // After sending any command or data on a nonblocking connection, call PQflush.
         // If it returns 1, wait for the socket to become read- or write-ready.
@@ -170,17 +891,102 @@ namespace db {
             if (ret == 0) {
                 _need_flush = false;
             }
+            else if (ret == 1) {
+                if (_metrics) {
+                    _metrics->flush_retries.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
             else if (ret == -1) {
                 log_error("[db] pool[%d] flush failed: %s", _id, error());
             }
         }
     }
 
+    void connection::receive_notifies(bool on) {
+        _notifies = on;
+    }
+    
+    void connection::notifies(std::vector<notification>& out) {
+        // consume() has read the input already while busy
+        if (!_is_busy && !PQconsumeInput(_conn)) {
+            log_error("[db] pool[%d] consume failed: %s", _id, PQerrorMessage(_conn));
+        }
+        while (PGnotify* n = PQnotifies(_conn)) {
+            out.push_back({n->relname, n->extra ? n->extra : "", n->be_pid});
+            PQfreemem(n);
+        }
+    }
+    
     bool connection::poll_reading() {
-        return _is_busy;
+        return _is_busy || _notifies;
     }
     
     bool connection::poll_writing() {
         return _need_flush;
     }
+    
+    void connection::unwatch(poller& p) {
+        if (_fd != -1 && _armed != poller::none) {
+            p.remove(_fd);
+        }
+        _armed = poller::none;
+    }
+    
+    std::chrono::steady_clock::time_point connection::last_used() const {
+        return _last_used;
+    }
+    
+    void connection::watch(poller& p) {
+        int fd = socket();
+        if (fd != _fd) {
+            // libpq opened a new socket (reset or next host while connecting)
+            if (_fd != -1 && _armed != poller::none) {
+                p.remove(_fd);
+            }
+            _fd = fd;
+            _armed = poller::none;
+        }
+        if (_fd == -1) {
+            return;
+        }
+        
+        uint32_t interest = poller::none;
+        if (_polling == PGRES_POLLING_READING) {
+            interest = poller::read;
+        }
+        else if (_polling == PGRES_POLLING_WRITING) {
+            interest = poller::write;
+        }
+        else if (_polling == PGRES_POLLING_OK) {
+            if (poll_reading()) {
+                interest |= poller::read;
+            }
+            if (poll_writing()) {
+                interest |= poller::write;
+            }
+        }
+        
+        if (interest == _armed) {
+            return;
+        }
+        
+        bool ok;
+        if (_armed == poller::none) {
+            ok = p.add(_fd, interest, this);
+        }
+        else if (interest == poller::none) {
+            // fails only if socket is already gone from epoll
+            p.remove(_fd);
+            ok = true;
+        }
+        else {
+            ok = p.modify(_fd, interest, this);
+        }
+        if (ok) {
+            _armed = interest;
+        }
+        else {
+            log_error("[db] pool[%d] failed to watch socket %d", _id, _fd);
+        }
+    }
 }
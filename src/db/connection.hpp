@@ -1,43 +1,147 @@
 #pragma once
 
+#include <chrono>
 #include <vector>
 #include <map>
 #include <string>
 #include "query.hpp"
+#include "statement_cache.hpp"
+#include "transaction.hpp"
+#include "listener.hpp"
 
 namespace db {
     
+    class poller;
     using connect_param_t = std::map<std::string, std::string>;
     
     class connection {
-        connection(PGconn* conn, int id);
+        connection(PGconn* conn, int id, int pipeline_depth, statement_cache&& statements, metrics* stats);
     public:
         connection() = delete;
         connection(const connection&) = delete;
         connection(connection&& other);
         ~connection();
         
-        static std::vector<connection> create(int count, const connect_param_t& param);
+        // pipeline_depth > 0 enables libpq pipeline mode with up to
+        // pipeline_depth queries in flight per connection.
+        // statements > 0 enables per connection prepared statement cache of that size.
+        // Connections are numbered from first_id and report resets, flush
+        // retries and time to first byte to metrics if set
+        static std::vector<connection> create(int count, const connect_param_t& param,
+                                              int pipeline_depth = 0, std::size_t statements = 0,
+                                              statement_cache::counters* stats = nullptr, int first_id = 0,
+                                              metrics* metrics = nullptr);
         
         const char* error();
         PostgresPollingStatusType status();
         const int& id() const;
         const bool& is_busy() const;
+        bool is_connected() const;
+        bool can_execute() const;
+        // Queries sent and not completed yet
+        std::size_t in_flight() const;
         int socket();
         bool reset();
         bool execute(query&& command);
         void consume();
         void flush();
         
+        bool is_copying() const;
+        // Streams buffered COPY data until the socket would block
+        void copy_data();
+        
+        // Keeps the socket readable while idle, so NOTIFY messages are picked up
+        void receive_notifies(bool on);
+        // Reads input if idle and moves notifications received so far to out
+        void notifies(std::vector<notification>& out);
+        
         bool poll_reading();
         bool poll_writing();
         
+        // Register socket in poller or re-arm it if read/write interest changed
+        void watch(poller& p);
+        // Drop socket from poller before the connection is closed
+        void unwatch(poller& p);
+        // When the last query was handed to the connection
+        std::chrono::steady_clock::time_point last_used() const;
+        
+        const statement_cache& statements() const;
         
     private:
+        // Protocol steps a query goes through, deallocate and prepare
+        // are only used with prepared statement cache
+        enum class step {
+            deallocate, prepare, execute
+        };
+        
+        struct pipelined {
+            query command;
+            bool internal = false;
+            bool prepare = false;
+            bool failed = false;
+            bool row_mode = false;
+            std::string statement;
+        };
+        
+        bool cacheable(const query& command) const;
+        step lookup(const query& command, std::string& statement, std::string& evicted);
+        // Statement cache key of command, reuses _key
+        const std::string& statement_key(const query& command);
+        bool set_row_mode(const query& command);
+        int send(step s, const query& command, const std::string& statement, const std::string& evicted);
+        bool execute_copy(query&& command);
+        bool execute_transaction(query&& command);
+        void consume_transaction();
+        // Hands results gathered so far to the statement whose results ended
+        void finish_transaction_step();
+        // Statements not run yet complete without results
+        void abort_transaction();
+        // Hands every available chunk to the sink, returns true once copy is over
+        bool read_copy_out();
+        bool execute_pipelined(query&& command);
+        void consume_pipelined();
+        
         int _id;
         PGconn* _conn;
         query _command;
+        step _step = step::execute;
+        std::string _statement;
+        std::string _evicted;
+        std::string _key;
+        statement_cache _statements;
+        
+        // COPY FROM STDIN / TO STDOUT in progress
+        std::shared_ptr<copy_in> _copy;
+        std::shared_ptr<copy_out> _sink;
+        std::string _copy_chunk;
+        bool _copy_started = false;
+        bool _copy_ended = false;
         bool _is_busy = false;
         bool _need_flush = false;
+        bool _notifies = false;
+        PostgresPollingStatusType _polling = PGRES_POLLING_WRITING;
+        int _fd = -1;
+        uint32_t _armed = 0;
+        std::chrono::steady_clock::time_point _last_used;
+        metrics* _metrics = nullptr;
+        // Oldest query sent without any response yet, for metrics::first_byte
+        std::chrono::steady_clock::time_point _sent;
+        bool _awaiting_response = false;
+        
+        // Transaction in progress, its steps are BEGIN, the statements, COMMIT
+        // and ROLLBACK after a failure
+        std::shared_ptr<transaction> _transaction;
+        std::size_t _tx_step = 0;
+        std::size_t _tx_steps = 0;
+        // Statements whose handlers were called
+        std::size_t _tx_done = 0;
+        bool _tx_failed = false;
+        bool _tx_rollback = false;
+        
+        // pipeline mode
+        int _pipeline_depth = 0;
+        std::list<pipelined> _inflight;
+        std::list<PGresult*> _results;
+        bool _await_sync = false;
     };
 }
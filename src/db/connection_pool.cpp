@@ -1,250 +1,1053 @@
 #include "connection_pool.hpp"
 #include "connection.hpp"
+#include "poller.hpp"
+#include "mpsc_ring.hpp"
+#include "coalesce.hpp"
+#include "scheduler.hpp"
+#include "codel.hpp"
 #include "../logger/logger.hpp"
 #include <unistd.h>
-#include <sys/ioctl.h>
-#include <fcntl.h>
+#include <sys/eventfd.h>
 #include <vector>
+#include <memory>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+#include <list>
+#include <chrono>
 
 
 namespace db {
     
-    namespace command {
-        char stop = '0';
-        char new_query = '1';
+    // How far into the backlog identical INSERTs are looked up
+    static constexpr std::size_t coalesce_window = 1024;
+    
+    // One event loop thread together with its submission queue
+    struct connection_pool::shard {
+        shard(connection_pool& pool, int id, std::size_t capacity)
+        : pool(pool), id(id), ring(capacity), queue(pool._options.tag_weights),
+          shedder(pool._options.shed_target, pool._options.shed_interval) {
+            eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (eventfd == -1) {
+                log_error("[db] failed to create eventfd");
+                throw std::runtime_error("failed to create connection pool");
+            }
+        }
+        
+        ~shard() {
+            if (eventfd != -1) {
+                close(eventfd);
+            }
+        }
+        
+        void notify() {
+            // Only the first producer after the loop has drained pays for the syscall
+            if (!notified.exchange(true, std::memory_order_acq_rel)) {
+                uint64_t one = 1;
+                write(eventfd, &one, sizeof(one));
+            }
+        }
+        
+        // Pops the next query, only high priority ones with high_only. With coalesce > 1
+        // queries with the same INSERT found among the next few ones are merged into it
+        bool take(db::query& q, std::size_t coalesce, bool high_only = false) {
+            if (retry.size() && (!high_only || retry.front().priority() == db::priority::high)) {
+                q = std::move(retry.front());
+                retry.pop_front();
+                return true;
+            }
+            
+            std::unique_lock<std::mutex> lock(mtx_queue);
+            std::size_t before = queue.size();
+            // Queries waiting too long are dropped at the head
+            std::vector<db::query> shed;
+            bool found = false;
+            while (!found && queue.pop(q, high_only)) {
+                if (shedder.enabled() && shedder.drop(q.enqueued(), codel::clock::now(), queue.empty())) {
+                    shed.push_back(std::move(q));
+                }
+                else {
+                    found = true;
+                }
+            }
+            
+            std::size_t tuple_pos;
+            std::vector<db::query> batch;
+            if (found && coalesce > 1 && queue.size() && is_coalescible(q, tuple_pos)) {
+                // libpq limits a statement to 65535 params
+                std::size_t count = q.params().size();
+                std::size_t limit = std::min(coalesce, 65535 / count);
+                batch.push_back(std::move(q));
+                queue.extract(batch.front(), coalesce_window, limit, [&batch, count](const db::query& other) {
+                    return other.sql() == batch.front().sql() &&
+                           other.params().size() == count && !other.is_streaming();
+                }, batch);
+            }
+            waiting.store(queue.size(), std::memory_order_relaxed);
+            pool.release(before - queue.size());
+            lock.unlock();
+            
+            if (shed.size()) {
+                pool._queue_stats.shed.fetch_add(shed.size(), std::memory_order_relaxed);
+                for(auto& d: shed) {
+                    d.call_handler({});
+                }
+            }
+            if (batch.size() == 1) {
+                q = std::move(batch.front());
+            }
+            else if (batch.size() > 1) {
+                q = db::coalesce(std::move(batch), tuple_pos, [this](std::vector<db::query>&& originals) {
+                    for(auto& o: originals) {
+                        retry.push_back(std::move(o));
+                    }
+                });
+            }
+            return found;
+        }
+        
+        void fail() {
+            for(auto& q: retry) {
+                q.call_handler({});
+            }
+            retry.clear();
+            std::vector<db::query> queued;
+            ring.drain([&queued](db::query&& q) {
+                queued.push_back(std::move(q));
+            });
+            {
+                std::lock_guard<std::mutex> lock(mtx_queue);
+                queue.clear(queued);
+                waiting.store(0, std::memory_order_relaxed);
+            }
+            pool.release(queued.size());
+            for(auto& q: queued) {
+                q.call_handler({});
+            }
+        }
+        
+        connection_pool& pool;
+        int id;
+        mpsc_ring<db::query> ring;
+        // Backlog of queries waiting for a free connection, other loops may steal from it
+        std::mutex mtx_queue;
+        scheduler queue;
+        std::atomic<std::size_t> waiting{0};
+        // Queries of a failed merged INSERT, executed one by one. Loop thread only
+        std::deque<db::query> retry;
+        std::atomic<bool> notified{false};
+        std::atomic<bool> hungry{false};
+        std::atomic<bool> alive{true};
+        std::atomic<bool> stop{false};
+        codel shedder;
+        int eventfd;
+        std::thread thr;
     };
     
-    connection_pool::connection_pool(int size): _size(size) {
-        _pipefd[0] = _pipefd[1] = -1;
-        if (pipe(_pipefd) == -1) {
-            log_error("[db] failed to create pipe");
-            throw std::runtime_error("failed to create connection pool");
+    connection_pool::connection_pool(int size, const pool_options& options)
+    : _size(size), _options(options) {
+        if (options.completions) {
+            _executor = options.completions;
+        }
+        else if (options.completion_threads > 0) {
+            _workers.reset(new worker_pool(options.completion_threads));
+            _executor = _workers.get();
+        }
+        if (options.cache) {
+            _cache = options.cache;
+        }
+        else if (options.result_cache > 0) {
+            _own_cache.reset(new result_cache(options.result_cache, &_cache_stats));
+            _cache = _own_cache.get();
+        }
+        int threads = std::max(1, std::min(options.threads, size));
+        for (int i = 0; i < threads; ++i) {
+            _shards.emplace_back(new shard(*this, i, submit_capacity / threads));
         }
     }
     
-    connection_pool::~connection_pool() {
-        if (_pipefd[0] != -1) {
-            close(_pipefd[0]);
+    connection_pool::~connection_pool() {}
+
+    // Set on event loop threads, where blocking on a full queue would deadlock
+    static thread_local bool on_loop_thread = false;
+    
+    bool connection_pool::async_query(db::query&& query) {
+        std::list<PGresult*> cached;
+        if (_cache && result_cache::cacheable(query) && _cache->serve(query, cached)) {
+            // not accounted in metrics, those describe the server
+            query.complete_on(_executor, nullptr);
+            query.call_handler(std::move(cached));
+            return true;
         }
-        if (_pipefd[1] != -1) {
-            close(_pipefd[1]);
+        if (!submit(query)) {
+            if (_options.on_full == overflow::fail) {
+                query.call_handler({});
+            }
+            return false;
         }
+        return true;
     }
-
-    void connection_pool::async_query(query&& query) {
-        std::unique_lock<std::mutex> lock(_mtx_queue);
-        bool empty = _queue.empty();
-        _queue.push_back(std::move(query));
-        lock.unlock();
+    
+    bool connection_pool::submit(db::query& query) {
+        if (!admit()) {
+            _queue_stats.rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        query.set_enqueued(std::chrono::steady_clock::now());
+        query.complete_on(_executor, &_metrics);
+        // Spread producers over loops without touching shared state
+        static thread_local std::size_t next = std::hash<std::thread::id>()(std::this_thread::get_id());
+        shard* s = _shards[next++ % _shards.size()].get();
+        for (std::size_t i = 1; i < _shards.size() && !s->alive.load(std::memory_order_relaxed); ++i) {
+            s = _shards[next++ % _shards.size()].get();
+        }
         
-        if (empty) {
-            // generate new notification
-            write(_pipefd[1], &command::new_query, 1);
+        if (!s->ring.push(std::move(query))) {
+            std::lock_guard<std::mutex> lock(s->mtx_queue);
+            s->queue.push(std::move(query));
+            s->waiting.store(s->queue.size(), std::memory_order_relaxed);
+        }
+        s->notify();
+        return true;
+    }
+    
+    bool connection_pool::async_query(db::query&& query, priority p, uint32_t tag) {
+        query.schedule(p, tag);
+        return async_query(std::move(query));
+    }
+    
+    bool connection_pool::admit() {
+        std::size_t capacity = _options.queue_capacity;
+        if (!capacity || _pending.fetch_add(1) < capacity) {
+            return true;
+        }
+        if (_options.on_full == overflow::block && !on_loop_thread) {
+            // Our own slot is already counted, so pending <= capacity means there is room
+            _blocked.fetch_add(1);
+            std::unique_lock<std::mutex> lock(_mtx_full);
+            _cv_full.wait(lock, [this, capacity] {
+                return _pending.load() <= capacity || _stopping.load();
+            });
+            _blocked.fetch_sub(1);
+            if (!_stopping.load()) {
+                return true;
+            }
+        }
+        else if (_options.on_full == overflow::block) {
+            return true;
+        }
+        _pending.fetch_sub(1);
+        return false;
+    }
+    
+    void connection_pool::release(std::size_t count) {
+        if (!_options.queue_capacity || !count) {
+            return;
+        }
+        _pending.fetch_sub(count);
+        if (_blocked.load() > 0) {
+            std::lock_guard<std::mutex> lock(_mtx_full);
+            _cv_full.notify_all();
+        }
+    }
+    
+    pending_query connection_pool::query(db::query&& command, executor* on) {
+        return pending_query(*this, std::move(command), on);
+    }
+    
+    pending_query connection_pool::query(std::string sql, db::query::params_t params, executor* on) {
+        return pending_query(*this, db::query(std::move(sql), std::move(params), nullptr), on);
+    }
+    
+    bool connection_pool::drain(shard& s) {
+        uint64_t counter;
+        read(s.eventfd, &counter, sizeof(counter));
+        // Reset before draining, so a query pushed during the drain triggers new wakeup
+        s.notified.exchange(false, std::memory_order_acq_rel);
+        if (s.stop.load(std::memory_order_acquire)) {
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(s.mtx_queue);
+        s.ring.drain([&s](db::query&& q) {
+            s.queue.push(std::move(q));
+        });
+        s.waiting.store(s.queue.size(), std::memory_order_relaxed);
+        return true;
+    }
+    
+    bool connection_pool::steal(shard& thief) {
+        shard* victim = nullptr;
+        std::size_t most = 0;
+        for(auto& s: _shards) {
+            std::size_t waiting = s->waiting.load(std::memory_order_relaxed);
+            if (s.get() != &thief && waiting > most) {
+                victim = s.get();
+                most = waiting;
+            }
+        }
+        if (!victim) {
+            return false;
+        }
+        
+        std::vector<db::query> stolen;
+        {
+            std::unique_lock<std::mutex> lock(victim->mtx_queue, std::try_to_lock);
+            if (!lock || victim->queue.empty()) {
+                return false;
+            }
+            // take the newest half of every tag, the victim keeps serving its oldest queries
+            victim->queue.split(stolen);
+            victim->waiting.store(victim->queue.size(), std::memory_order_relaxed);
+        }
+        
+        std::lock_guard<std::mutex> lock(thief.mtx_queue);
+        for(auto& q: stolen) {
+            thief.queue.push(std::move(q));
+        }
+        thief.waiting.store(thief.queue.size(), std::memory_order_relaxed);
+        return true;
+    }
+    
+    void connection_pool::wake_hungry(shard& s) {
+        for(auto& other: _shards) {
+            if (other.get() != &s && other->hungry.exchange(false, std::memory_order_relaxed)) {
+                other->notify();
+                return;
+            }
         }
     }
 
+    bool connection_pool::async_transaction(db::transaction&& tx, priority p, uint32_t tag) {
+        auto shared = std::make_shared<db::transaction>(std::move(tx));
+        for(auto& q: shared->statements()) {
+            q.complete_on(_executor, nullptr);
+        }
+        db::query command(shared->begin(), shared);
+        command.schedule(p, tag);
+        if (!submit(command)) {
+            if (_options.on_full == overflow::fail) {
+                command.call_handler({});
+            }
+            else {
+                tx = std::move(*shared);
+                command.on_done(nullptr);
+            }
+            return false;
+        }
+        return true;
+    }
+    
+    uint64_t connection_pool::subscribe(const std::string& channel, listener::callback_t on_notify) {
+        uint64_t id = _listener.subscribe(channel, std::move(on_notify));
+        if (shard* s = listener_loop()) {
+            s->notify();
+        }
+        else {
+            log_error("[db] no running loop to listen on %s", channel.c_str());
+        }
+        return id;
+    }
+    
+    void connection_pool::unsubscribe(uint64_t id) {
+        if (!_listener.unsubscribe(id)) {
+            return;
+        }
+        if (shard* s = listener_loop()) {
+            s->notify();
+        }
+    }
+    
+    connection_pool::shard* connection_pool::listener_loop() {
+        for(auto& s: _shards) {
+            if (s->alive.load(std::memory_order_relaxed)) {
+                return s.get();
+            }
+        }
+        return nullptr;
+    }
+    
+    std::shared_ptr<copy_in> connection_pool::copy_from(const std::string& sql, copy_in::callback_t on_done) {
+        auto copy = std::make_shared<copy_in>(on_done);
+        async_query(db::query(sql, copy));
+        return copy;
+    }
+    
+    void connection_pool::copy_to(const std::string& sql, copy_out::sink_t sink, copy_out::callback_t on_done) {
+        async_query(db::query(sql, std::make_shared<copy_out>(sink, on_done)));
+    }
+    
+    void connection_pool::invalidate(const std::string& sql) {
+        if (_cache) {
+            _cache->invalidate(sql);
+        }
+    }
+    
+    void connection_pool::invalidate() {
+        if (_cache) {
+            _cache->clear();
+        }
+    }
+    
+    const result_cache::counters& connection_pool::cache_stats() const {
+        return _cache_stats;
+    }
+    
+    const statement_cache::counters& connection_pool::statement_stats() const {
+        return _statement_stats;
+    }
+    
+    const completion_counters& connection_pool::completion_stats() const {
+        return _metrics.completions;
+    }
+    
+    metrics::snapshot connection_pool::snapshot() const {
+        metrics::snapshot snap = _metrics.take();
+        for(auto& s: _shards) {
+            snap.queue_depth += s->waiting.load(std::memory_order_relaxed);
+        }
+        return snap;
+    }
+    
+    std::string connection_pool::prometheus() const {
+        std::string out = db::prometheus(snapshot());
+        auto counter = [&out](const char* name, const char* help, uint64_t value) {
+            out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n" +
+                   name + " " + std::to_string(value) + "\n";
+        };
+        counter("db_statement_cache_hits_total", "Prepared statement cache hits",
+                _statement_stats.hits.load(std::memory_order_relaxed));
+        counter("db_statement_cache_misses_total", "Prepared statement cache misses",
+                _statement_stats.misses.load(std::memory_order_relaxed));
+        counter("db_statement_cache_evictions_total", "Prepared statements deallocated",
+                _statement_stats.evictions.load(std::memory_order_relaxed));
+        counter("db_result_cache_hits_total", "Queries answered from the result cache",
+                _cache_stats.hits.load(std::memory_order_relaxed));
+        counter("db_result_cache_misses_total", "Cacheable queries sent to the server",
+                _cache_stats.misses.load(std::memory_order_relaxed));
+        counter("db_result_cache_evictions_total", "Cached results dropped to stay within the budget",
+                _cache_stats.evictions.load(std::memory_order_relaxed));
+        out += "# HELP db_result_cache_bytes Memory held by cached results\n# TYPE db_result_cache_bytes gauge\n"
+               "db_result_cache_bytes " + std::to_string(_cache_stats.bytes.load(std::memory_order_relaxed)) + "\n";
+        counter("db_handler_queued_nanoseconds_total", "Time handlers waited for their executor",
+                _metrics.completions.queued_ns.load(std::memory_order_relaxed));
+        counter("db_handler_run_nanoseconds_total", "Time handlers ran",
+                _metrics.completions.run_ns.load(std::memory_order_relaxed));
+        counter("db_rejected_total", "Queries refused by a full queue",
+                _queue_stats.rejected.load(std::memory_order_relaxed));
+        counter("db_shed_total", "Queries dropped by the load shedder",
+                _queue_stats.shed.load(std::memory_order_relaxed));
+        return out;
+    }
+    
+    const queue_counters& connection_pool::queue_stats() const {
+        return _queue_stats;
+    }
+    
+    int64_t connection_pool::connected() const {
+        return _metrics.connected_connections.load(std::memory_order_relaxed);
+    }
+    
     void connection_pool::run(const connect_param_t &params) {
-        _thr = std::thread(&connection_pool::loop, this, params);
+        for(auto& s: _shards) {
+            s->thr = std::thread(&connection_pool::loop, this, std::ref(*s), params);
+        }
     }
     
     void connection_pool::stop() {
-        write(_pipefd[1], &command::stop, 1);
-        _thr.join();
-        
-        std::unique_lock<std::mutex> lock(_mtx_queue);
-        _queue.clear();
+        {
+            std::lock_guard<std::mutex> lock(_mtx_full);
+            _stopping.store(true);
+            _cv_full.notify_all();
+        }
+        for(auto& s: _shards) {
+            s->stop.store(true, std::memory_order_release);
+            uint64_t one = 1;
+            write(s->eventfd, &one, sizeof(one));
+        }
+        for(auto& s: _shards) {
+            if (s->thr.joinable()) {
+                s->thr.join();
+            }
+        }
+        for(auto& s: _shards) {
+            s->fail();
+        }
+        // Every handler has run once stop returns
+        if (_workers) {
+            _workers->stop();
+        }
     }
 
-    void connection_pool::loop(const connect_param_t& params) {
+    void connection_pool::loop(shard& s, const connect_param_t& params) {
+        on_loop_thread = true;
         
-        // Create pool
-        std::vector<connection> pool;
+        // Create this loop's slice of the pool
+        int shards = (int)_shards.size();
+        int count = _size / shards + (s.id < _size % shards ? 1 : 0);
+        int first_id = s.id * (_size / shards) + std::min(s.id, _size % shards);
+        // Share of reserved connections, at least one is left for the rest
+        int reserved = std::min((_options.reserved_high * count + _size - 1) / std::max(1, _size), count - 1);
+        // Elastic pool starts with its share of min_size and grows up to count
+        bool elastic = _options.min_size > 0 && _options.min_size < _size;
+        int low = count;
+        if (elastic) {
+            low = std::max(1, _options.min_size / shards + (s.id < _options.min_size % shards ? 1 : 0));
+        }
+        // Connections are erased when the pool shrinks, so they are kept in a list
+        std::list<connection> pool;
+        std::vector<bool> used(count, false);
         try {
-            pool = connection::create(_size, params);
+            for(auto& c: connection::create(low, params, _options.pipeline_depth, _options.statement_cache,
+                                            &_statement_stats, first_id, &_metrics)) {
+                pool.push_back(std::move(c));
+            }
+            std::fill(used.begin(), used.begin() + low, true);
         }
         catch(const std::exception& e) {
             log_error("[db] failed to create connection pool: %s", e.what());
+            s.alive.store(false, std::memory_order_relaxed);
             return;
         }
         
-        std::list<query> queries;
-        auto clear = [this, &queries] {
-            
-            for(auto& q: queries) {
-                q.call_handler({});
+        // Busy and connected connections of this loop counted in metrics
+        int64_t busy = 0;
+        int64_t online = 0;
+        auto clear = [&s, &busy, &online, this] {
+            _metrics.busy_connections.fetch_sub(busy, std::memory_order_relaxed);
+            _metrics.connected_connections.fetch_sub(online, std::memory_order_relaxed);
+            busy = 0;
+            online = 0;
+            // new queries go to other loops from now on
+            s.alive.store(false, std::memory_order_relaxed);
+            s.hungry.store(false, std::memory_order_relaxed);
+            s.fail();
+            // the next live loop takes over LISTEN
+            if (_listener.active()) {
+                if (shard* next = listener_loop()) {
+                    next->notify();
+                }
             }
-            
-            // consume read pipe
-            int bytes_available;
-            bool has_query = false;
-            if(ioctl(_pipefd[0], FIONREAD, &bytes_available) == 0 && bytes_available > 0) {
-                char* dummy = new char[bytes_available];
-                read(_pipefd[0], dummy, bytes_available);
-                delete[] dummy;
+        };
+        
+        std::unique_ptr<poller> events;
+        try {
+            events.reset(new poller());
+        }
+        catch(const std::exception& e) {
+            log_error("[db] failed to create connection pool: %s", e.what());
+            clear();
+            return;
+        }
+        events->add(s.eventfd, poller::read, nullptr);
+        
+        // Connections which are connected and can accept one more query
+        std::deque<connection*> idle;
+        using clock = std::chrono::steady_clock;
+        // Connections whose reset could not be started, retried from retry_after on
+        std::vector<connection*> broken;
+        clock::time_point retry_after;
+        // Connections running COPY and copies waiting for a free connection
+        std::vector<connection*> copying;
+        std::deque<db::query> copies;
+        std::size_t connected = 0;
+        bool is_connected = false;
+        
+        // Leaves c alone until retry_after, e.g. while the server is down
+        auto back_off = [&broken, &retry_after, &events](connection& c) {
+            c.unwatch(*events);
+            if (std::find(broken.begin(), broken.end(), &c) != broken.end()) {
+                return;
             }
-            
-            std::lock_guard<std::mutex> lock(_mtx_queue);
-            for(auto& q: _queue) {
-                q.call_handler({});
+            if (broken.empty()) {
+                retry_after = clock::now() + std::chrono::seconds(1);
             }
-            _queue.clear();
+            broken.push_back(&c);
         };
         
-        // Wait for initial connection
-        log_info("[db] connection pool is created. waiting for connection");
-        while (true) {
-            int maxsfd = _pipefd[0];
-            fd_set readfds, writefds;
-            FD_SET(_pipefd[0], &readfds);
-            FD_ZERO(&writefds);
-            bool is_connected = true;
-            for(auto& c: pool) {
-                int sock = c.socket();
-                switch (c.status()) {
+        auto restart = [&back_off](connection& c) {
+            log_error("[db] pool[%d] connection aborted: %s", c.id(), c.error());
+            if (!c.reset()) {
+                log_error("[db] pool[%d] reset failed: %s", c.id(), c.error());
+                back_off(c);
+            }
+        };
+        
+        // Elastic sizing state. Connections being opened on top of the initial ones
+        std::vector<connection*> opening;
+        clock::time_point last_grow;
+        clock::time_point grow_after;
+        clock::duration recent_wait = clock::duration::zero();
+        
+        // Gauge state of every connection slot, brought up to date with account()
+        // wherever the loop touched a connection
+        std::vector<bool> counted_busy(count, false);
+        std::vector<bool> counted_online(count, false);
+        auto account = [&](connection& c, bool gone = false) {
+            std::size_t slot = c.id() - first_id;
+            bool is_busy = !gone && c.is_busy();
+            bool is_online = !gone && c.is_connected();
+            if (is_busy != counted_busy[slot]) {
+                counted_busy[slot] = is_busy;
+                busy += is_busy ? 1 : -1;
+                _metrics.busy_connections.fetch_add(is_busy ? 1 : -1, std::memory_order_relaxed);
+            }
+            if (is_online != counted_online[slot]) {
+                counted_online[slot] = is_online;
+                online += is_online ? 1 : -1;
+                _metrics.connected_connections.fetch_add(is_online ? 1 : -1, std::memory_order_relaxed);
+            }
+        };
+        
+        // While COPY or a transaction waits, this connection gets no new queries
+        // so it drains, pipelining would otherwise keep every connection busy
+        connection* draining = nullptr;
+        
+        // Closes a connection which is neither idle nor running anything
+        auto discard = [&](connection* c) {
+            if (draining == c) {
+                draining = nullptr;
+            }
+            account(*c, true);
+            c->unwatch(*events);
+            used[c->id() - first_id] = false;
+            pool.remove_if([c](const connection& other) {
+                return &other == c;
+            });
+        };
+        
+        auto open = [&] {
+            int slot = (int)(std::find(used.begin(), used.end(), false) - used.begin());
+            try {
+                auto created = connection::create(1, params, _options.pipeline_depth, _options.statement_cache,
+                                                  &_statement_stats, first_id + slot, &_metrics);
+                pool.push_back(std::move(created.front()));
+            }
+            catch(const std::exception& e) {
+                log_error("[db] loop[%d] failed to open connection: %s", s.id, e.what());
+                grow_after = clock::now() + std::chrono::seconds(1);
+                return;
+            }
+            used[slot] = true;
+            last_grow = clock::now();
+            connection& c = pool.back();
+            log_info("[db] pool[%d] opening, loop[%d] grows to %d connections", c.id(), s.id, (int)pool.size());
+            switch (c.status()) {
+                case PGRES_POLLING_OK:
+                    idle.push_back(&c);
+                    account(c);
+                    break;
+                case PGRES_POLLING_FAILED:
+                    log_error("[db] pool[%d] failed to open: %s", c.id(), c.error());
+                    grow_after = clock::now() + std::chrono::seconds(1);
+                    discard(&c);
+                    return;
+                default:
+                    opening.push_back(&c);
+                    break;
+            }
+            c.watch(*events);
+        };
+        
+        // Connection of the first live loop running LISTEN, open while there are
+        // subscriptions and numbered after the pool connections
+        std::unique_ptr<connection> subscriber;
+        clock::time_point subscribe_after;
+        bool relisten = false;
+        
+        auto drop_subscriber = [&] {
+            subscriber->unwatch(*events);
+            subscriber.reset();
+            subscribe_after = clock::now() + std::chrono::seconds(1);
+        };
+        
+        auto open_subscriber = [&] {
+            try {
+                // not in the pool metrics, its resets and waits say nothing about queries
+                auto created = connection::create(1, params, 0, 0, nullptr, _size, nullptr);
+                subscriber.reset(new connection(std::move(created.front())));
+            }
+            catch(const std::exception& e) {
+                log_error("[db] loop[%d] failed to open listener: %s", s.id, e.what());
+                subscribe_after = clock::now() + std::chrono::seconds(1);
+                return;
+            }
+            subscriber->receive_notifies(true);
+            relisten = true;
+            if (subscriber->status() == PGRES_POLLING_FAILED) {
+                log_error("[db] pool[%d] listener failed: %s", subscriber->id(), subscriber->error());
+                drop_subscriber();
+                return;
+            }
+            subscriber->watch(*events);
+        };
+        
+        // Brings LISTEN in line with subscriptions once the connection is free
+        auto sync_subscriber = [&] {
+            if (!subscriber->is_connected() || subscriber->is_busy()) {
+                return;
+            }
+            std::string sql = _listener.sync(relisten);
+            relisten = false;
+            if (sql.empty()) {
+                return;
+            }
+            int id = subscriber->id();
+            subscriber->execute(db::query(sql, [id](std::list<PGresult*> results) {
+                for(auto r: results) {
+                    if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+                        log_error("[db] pool[%d] listen failed: %s", id, PQresultErrorMessage(r));
+                    }
+                    PQclear(r);
+                }
+            }));
+            subscriber->watch(*events);
+        };
+        
+        auto notify = [&] {
+            std::vector<notification> received;
+            subscriber->notifies(received);
+            std::vector<std::shared_ptr<listener::callback_t>> callbacks;
+            for(auto& n: received) {
+                callbacks.clear();
+                _listener.subscribers(n, callbacks);
+                for(auto& cb: callbacks) {
+                    if (_executor) {
+                        _executor->post([cb, n] {
+                            (*cb)(n);
+                        });
+                    }
+                    else {
+                        (*cb)(n);
+                    }
+                }
+            }
+        };
+        
+        auto on_subscriber = [&](uint32_t ev) {
+            connection* c = subscriber.get();
+            if (!c->is_connected()) {
+                switch (c->status()) {
                     case PGRES_POLLING_OK:
-                        log_info("[db] pool[%d] connected", c.id());
+                        log_info("[db] pool[%d] listener connected", c->id());
+                        relisten = true;
                         break;
                     case PGRES_POLLING_FAILED:
-                        log_error("[db] pool[%d] failed: %s", c.id(), c.error());
-                        clear();
+                        log_error("[db] pool[%d] listener failed: %s", c->id(), c->error());
+                        drop_subscriber();
                         return;
-                    case PGRES_POLLING_READING:
-                        FD_SET(c.socket(), &readfds);
-                        is_connected = false;
-                        maxsfd = std::max(sock, maxsfd);
-                        break;
-                    case PGRES_POLLING_WRITING:
-                        FD_SET(c.socket(), &writefds);
-                        is_connected = false;
-                        maxsfd = std::max(sock, maxsfd);
-                        break;
                     default:
                         break;
                 }
+                c->watch(*events);
+                return;
             }
-        
-            if (is_connected) {
-                break;
-            }
-            else if (select(maxsfd + 1, &readfds, &writefds, nullptr, nullptr) > 0) {
-                if (FD_ISSET(_pipefd[0], &readfds)) {
-                    int bytes_available;
-                    bool has_query = false;
-                    if(ioctl(_pipefd[0], FIONREAD, &bytes_available) == 0) {
-                        for(int i = 0; i < bytes_available; ++i) {
-                            char cmd;
-                            read(_pipefd[0], &cmd, 1);
-                            if (cmd == command::stop) {
-                                log_info("[db] stop called");
-                                clear();
-                                return;
-                            }
-                            else if (cmd == command::new_query) {
-                                has_query = true;
-                            }
-                        }
-                    }
-                    
-                    if (has_query) {
-                        std::lock_guard<std::mutex> lock(_mtx_queue);
-                        for(auto& q: _queue) {
-                            queries.push_back(std::move(q));
-                        }
-                        _queue.clear();
-                    }
+            if (ev & poller::read) {
+                c->consume();
+            }
+            if (ev & poller::write) {
+                c->flush();
+            }
+            notify();
+            if (!c->is_busy() && c->status() == PGRES_POLLING_FAILED) {
+                log_error("[db] pool[%d] listener aborted: %s", c->id(), c->error());
+                if (!c->reset()) {
+                    log_error("[db] pool[%d] reset failed: %s", c->id(), c->error());
+                    drop_subscriber();
+                    return;
                 }
             }
+            c->watch(*events);
+        };
+        
+        auto shrink = [&](connection* c) {
+            log_info("[db] pool[%d] closing, loop[%d] shrinks to %d connections", c->id(), s.id, (int)pool.size() - 1);
+            idle.erase(std::find(idle.begin(), idle.end(), c));
+            discard(c);
+        };
+        
+        // Wait for initial connection
+        log_info("[db] loop[%d] is created. waiting for connection", s.id);
+        for(auto& c: pool) {
+            switch (c.status()) {
+                case PGRES_POLLING_OK:
+                    log_info("[db] pool[%d] connected", c.id());
+                    idle.push_back(&c);
+                    account(c);
+                    ++connected;
+                    break;
+                case PGRES_POLLING_FAILED:
+                    log_error("[db] pool[%d] failed: %s", c.id(), c.error());
+                    clear();
+                    return;
+                default:
+                    break;
+            }
+            c.watch(*events);
         }
-        log_info("[db] connection pool is connected");
         
-        struct timeval tv = {3, 0};
         while (true) {
-            fd_set readfds, writefds;
-            FD_SET(_pipefd[0], &readfds);
-            FD_ZERO(&writefds);
-            int maxsfd = _pipefd[0];
+            if (!is_connected && connected == pool.size()) {
+                is_connected = true;
+                log_info("[db] loop[%d] is connected", s.id);
+            }
             
-            // Check connection
-            for(auto& c: pool) {
-                int sock = c.socket();
-                switch (c.status()) {
-                    case PGRES_POLLING_OK:
-                        if (queries.size() && !c.is_busy()) {
-                            c.execute(std::move(queries.front()));
-                            queries.pop_front();
-                        }
-                        break;
-                    case PGRES_POLLING_FAILED:
-                        log_error("[db] pool[%d] connection aborted: %s", c.id(), c.error());
-                        c.reset();
-                        FD_SET(sock, &readfds);
-                        maxsfd = std::max(maxsfd, sock);
-                        break;
-                    case PGRES_POLLING_WRITING:
-                        FD_SET(sock, &writefds);
-                        maxsfd = std::max(maxsfd, sock);
-                        break;
-                    case PGRES_POLLING_READING:
-                        FD_SET(sock, &readfds);
-                        maxsfd = std::max(maxsfd, sock);
-                        break;
-                    default:
-                        break;
+            // Feed running COPY FROM STDIN from its producers
+            for (auto it = copying.begin(); it != copying.end();) {
+                connection* c = *it;
+                if (c->is_copying()) {
+                    c->copy_data();
+                    account(*c);
+                    c->watch(*events);
+                    ++it;
                 }
-                
-                if (c.poll_reading()) {
-                    FD_SET(sock, &readfds);
-                    maxsfd = std::max(maxsfd, sock);
+                else {
+                    it = copying.erase(it);
                 }
-                
-                if (c.poll_writing()) {
-                    FD_SET(sock, &writefds);
-                    maxsfd = std::max(maxsfd, sock);
+            }
+            
+            // COPY and transactions need a connection without queries in flight
+            auto dispatch_copy = [&](db::query& q) {
+                auto it = std::find_if(idle.begin(), idle.end(), [](connection* c) {
+                    return !c->is_busy();
+                });
+                if (it == idle.end()) {
+                    return false;
+                }
+                connection& c = **it;
+                idle.erase(it);
+                if (draining == &c) {
+                    draining = nullptr;
+                }
+                if (q.copy()) {
+                    q.copy()->attach([&s] {
+                        s.notify();
+                    });
+                }
+                if (c.execute(std::move(q))) {
+                    copying.push_back(&c);
+                }
+                else if (c.status() == PGRES_POLLING_FAILED) {
+                    restart(c);
+                }
+                else {
+                    idle.push_back(&c);
+                }
+                account(c);
+                c.watch(*events);
+                return true;
+            };
+            while (is_connected && copies.size() && dispatch_copy(copies.front())) {
+                copies.pop_front();
+            }
+            
+            // Dispatch queued queries to idle connections, round robin.
+            // Out of own work, take some from a backlogged loop.
+            // The last reserved idle connections only take high priority queries,
+            // an elastic loop below its full size keeps at least one for the rest.
+            // They do not steal, that would only move other loops' normal work here
+            db::query q;
+            int reserved_now = std::min(reserved, (int)pool.size() - 1);
+            auto next = [&] {
+                bool high_only = (int)idle.size() <= reserved_now;
+                return s.take(q, _options.coalesce, high_only) ||
+                       (!high_only && steal(s) && s.take(q, _options.coalesce));
+            };
+            // Next connection for a query, skipping the draining one
+            auto available = [&] {
+                if (idle.empty()) {
+                    return false;
+                }
+                if (copies.size() && !draining) {
+                    draining = *std::min_element(idle.begin(), idle.end(), [](connection* a, connection* b) {
+                        return a->in_flight() < b->in_flight();
+                    });
+                }
+                if (idle.front() == draining) {
+                    idle.pop_front();
+                    idle.push_back(draining);
+                }
+                return idle.front() != draining;
+            };
+            if (copies.empty()) {
+                draining = nullptr;
+            }
+            clock::time_point now = clock::now();
+            while (is_connected && available() && next()) {
+                recent_wait = std::max(recent_wait, now - q.enqueued());
+                _metrics.queue_wait.record(now - q.enqueued());
+                if (q.is_exclusive()) {
+                    if (copies.size() || !dispatch_copy(q)) {
+                        copies.push_back(std::move(q));
+                    }
+                    continue;
+                }
+                connection& c = *idle.front();
+                idle.pop_front();
+                if (!c.execute(std::move(q)) && c.status() == PGRES_POLLING_FAILED) {
+                    restart(c);
+                }
+                else if (c.can_execute()) {
+                    idle.push_back(&c);
+                }
+                account(c);
+                c.watch(*events);
+            }
+            if (is_connected) {
+                bool backlogged = s.waiting.load(std::memory_order_relaxed) > 0;
+                s.hungry.store(!backlogged && idle.size(), std::memory_order_relaxed);
+                if (backlogged) {
+                    wake_hungry(s);
+                }
+            }
+            
+            // LISTEN/NOTIFY is served by the first live loop only. Closing the
+            // connection unlistens from every channel
+            bool listening = _listener.active();
+            if (subscriber && !listening) {
+                log_info("[db] pool[%d] listener closed", subscriber->id());
+                subscriber->unwatch(*events);
+                subscriber.reset();
+            }
+            if (listening && is_connected && listener_loop() == &s) {
+                if (!subscriber && now >= subscribe_after) {
+                    open_subscriber();
+                }
+                if (subscriber) {
+                    sync_subscriber();
+                }
+            }
+            
+            // Grow while queries pile up, shrink by idle connections after a calm period
+            if (elastic && is_connected) {
+                std::size_t backlog = s.waiting.load(std::memory_order_relaxed);
+                if (opening.empty() && (int)pool.size() < count && now >= grow_after &&
+                    (backlog > _options.grow_backlog || recent_wait > _options.grow_wait)) {
+                    open();
+                }
+                else if (opening.empty() && (int)pool.size() > low && backlog == 0 &&
+                         now - last_grow >= _options.idle_timeout) {
+                    auto it = std::find_if(idle.begin(), idle.end(), [this, now](connection* c) {
+                        return !c->is_busy() && now - c->last_used() >= _options.idle_timeout;
+                    });
+                    if (it != idle.end()) {
+                        shrink(*it);
+                    }
                 }
+                recent_wait = clock::duration::zero();
+            }
+            
+            if (broken.size() && clock::now() >= retry_after) {
+                std::vector<connection*> retry;
+                retry.swap(broken);
+                for(auto c: retry) {
+                    if (c->reset()) {
+                        c->watch(*events);
+                    }
+                    else {
+                        broken.push_back(c);
+                    }
+                    account(*c);
+                }
+                retry_after = clock::now() + std::chrono::seconds(1);
             }
             
             // Wait for data avaiability
-            if (select(maxsfd + 1, &readfds, &writefds, NULL, &tv) > 0) {
+            int timeout = 3000;
+            if (elastic) {
+                timeout = (int)std::max<int64_t>(1, std::min<int64_t>(timeout, _options.idle_timeout.count() / 2));
+            }
+            if (listening && is_connected && !subscriber && listener_loop() == &s) {
+                auto retry = std::chrono::duration_cast<std::chrono::milliseconds>(subscribe_after - clock::now());
+                timeout = (int)std::max<int64_t>(1, std::min<int64_t>(timeout, retry.count()));
+            }
+            if (broken.size()) {
+                auto retry = std::chrono::duration_cast<std::chrono::milliseconds>(retry_after - clock::now());
+                timeout = (int)std::max<int64_t>(1, std::min<int64_t>(timeout, retry.count()));
+            }
+            int ready = events->wait(timeout);
+            if (ready == 0) {
+                continue;
+            }
+            
+            for(int i = 0; i < ready; ++i) {
+                connection* c = static_cast<connection*>(events->data(i));
                 
                 // handle commands
-                if (FD_ISSET(_pipefd[0], &readfds)) {
-                    int bytes_available;
-                    bool has_query = false;
-                    if(ioctl(_pipefd[0], FIONREAD, &bytes_available) == 0) {
-                        for(int i = 0; i < bytes_available; ++i) {
-                            char cmd;
-                            read(_pipefd[0], &cmd, 1);
-                            if (cmd == command::stop) {
-                                log_info("[db] stop called");
+                if (!c) {
+                    if (!drain(s)) {
+                        log_info("[db] stop called");
+                        clear();
+                        return;
+                    }
+                    continue;
+                }
+                
+                if (c == subscriber.get()) {
+                    on_subscriber(events->events(i));
+                    continue;
+                }
+                
+                // handle connection establishment
+                if (!c->is_connected()) {
+                    auto grown = std::find(opening.begin(), opening.end(), c);
+                    switch (c->status()) {
+                        case PGRES_POLLING_OK:
+                            log_info("[db] pool[%d] connected", c->id());
+                            idle.push_back(c);
+                            if (!is_connected) {
+                                ++connected;
+                            }
+                            if (grown != opening.end()) {
+                                opening.erase(grown);
+                            }
+                            break;
+                        case PGRES_POLLING_FAILED:
+                            if (!is_connected) {
+                                log_error("[db] pool[%d] failed: %s", c->id(), c->error());
                                 clear();
                                 return;
                             }
-                            else if (cmd == command::new_query) {
-                                has_query = true;
+                            if (grown != opening.end()) {
+                                // e.g. server is out of connection slots, try again later
+                                log_error("[db] pool[%d] failed to open: %s", c->id(), c->error());
+                                opening.erase(grown);
+                                grow_after = clock::now() + std::chrono::seconds(1);
+                                discard(c);
+                                continue;
                             }
-                        }
-                    }
-                    
-                    if (has_query) {
-                        std::lock_guard<std::mutex> lock(_mtx_queue);
-                        for(auto& q: _queue) {
-                            queries.push_back(std::move(q));
-                        }
-                        _queue.clear();
+                            log_error("[db] pool[%d] reconnect failed: %s", c->id(), c->error());
+                            back_off(*c);
+                            account(*c);
+                            continue;
+                        default:
+                            break;
                     }
+                    account(*c);
+                    c->watch(*events);
+                    continue;
                 }
                 
                 // handle queries
-                for(auto& p: pool) {
-                    int sock = p.socket();
-                    if (FD_ISSET(sock, &readfds)) {
-                        p.consume();
-                    }
-                    if (FD_ISSET(sock, &writefds)) {
-                        p.flush();
+                bool was_full = !c->can_execute();
+                uint32_t ev = events->events(i);
+                if (ev & poller::read) {
+                    c->consume();
+                }
+                if (ev & poller::write) {
+                    c->flush();
+                }
+                if (!c->is_busy() && c->status() == PGRES_POLLING_FAILED) {
+                    if (!was_full) {
+                        idle.erase(std::find(idle.begin(), idle.end(), c));
                     }
+                    restart(*c);
                 }
-                
+                else if (was_full && c->can_execute()) {
+                    idle.push_back(c);
+                }
+                account(*c);
+                c->watch(*events);
             }
         }
         
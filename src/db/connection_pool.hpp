@@ -3,29 +3,237 @@
 #include <string>
 #include <functional>
 #include <list>
+#include <memory>
+#include <vector>
 #include <map>
+#include <unordered_map>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <libpq-fe.h>
 #include "connection.hpp"
+#include "executor.hpp"
+#include "worker_pool.hpp"
+#include "result.hpp"
+#include "transaction.hpp"
+#include "listener.hpp"
+#include "result_cache.hpp"
 
 namespace db {
+    
+    // What async_query does when queue_capacity queries are already waiting
+    enum class overflow {
+        // wait for room, except on loop threads where the query is let through
+        block,
+        // return false, query is left untouched
+        reject,
+        // return false after calling the handler without results
+        fail
+    };
+
+    struct pool_options {
+        // > 0 lets each connection keep up to pipeline_depth queries
+        // in flight using libpq pipeline mode
+        int pipeline_depth = 0;
+        // > 0 lets each connection keep up to statement_cache prepared
+        // statements, parameterized queries are prepared on first use
+        std::size_t statement_cache = 0;
+        // number of event loops, connections are split evenly between them
+        int threads = 1;
+        // > 1 merges up to coalesce queued "INSERT ... VALUES ($1, ...)" queries
+        // with the same SQL into one multi row INSERT. Each merged query then gets
+        // an empty PGRES_COMMAND_OK result: libpq cannot set a command tag, so
+        // PQcmdStatus() and PQcmdTuples() return "" instead of "INSERT 0 1"
+        std::size_t coalesce = 0;
+        // Where completion handlers run: inline on the loop thread by default,
+        // on completion_threads workers, or on completions if set
+        int completion_threads = 0;
+        executor* completions = nullptr;
+        // Weight of every tag inside its priority class, tags not listed get 1
+        std::unordered_map<uint32_t, unsigned> tag_weights;
+        // Connections kept for priority::high queries, split between event loops
+        int reserved_high = 0;
+        // > 0 bounds the number of submitted queries waiting for a connection
+        std::size_t queue_capacity = 0;
+        overflow on_full = overflow::block;
+        // > 0 drops queries at the head of the backlog once they have waited
+        // longer than shed_target for a whole shed_interval (CoDel)
+        std::chrono::milliseconds shed_target{0};
+        std::chrono::milliseconds shed_interval{100};
+        // With 0 < min_size < size the pool starts with min_size connections and
+        // opens more, one at a time, up to size while more than grow_backlog
+        // queries wait in a loop or queries waited longer than grow_wait.
+        // Connections unused for idle_timeout are closed again, but not sooner
+        // than idle_timeout after the last one was opened
+        int min_size = 0;
+        std::size_t grow_backlog = 8;
+        std::chrono::milliseconds grow_wait{20};
+        std::chrono::milliseconds idle_timeout{30000};
+        // > 0 keeps up to result_cache bytes of results of queries with
+        // query::cache_for(). Hits complete inside async_query, through the
+        // completion executor if there is one, without reaching a loop.
+        // cache, if set, is used instead and may be shared between pools. It
+        // counts in the counters it was created with, not in cache_stats()
+        std::size_t result_cache = 0;
+        db::result_cache* cache = nullptr;
+    };
+    
+    struct queue_counters {
+        // refused by a full queue
+        std::atomic<uint64_t> rejected{0};
+        // dropped by the shedder, their handlers got no results
+        std::atomic<uint64_t> shed{0};
+    };
+
+    class pending_query;
 
     class connection_pool {
     public:
-        connection_pool(int size);
+        connection_pool(int size, const pool_options& options = pool_options());
         ~connection_pool();
         void run(const connect_param_t& params);
         void stop();
         
-        void async_query(query&& query);
+        // Lock-free unless the submission ring of the chosen loop is full,
+        // then query is spilled to the loop backlog under a mutex.
+        // Returns false if the query was refused, see pool_options::on_full
+        bool async_query(db::query&& query);
+        bool async_query(db::query&& query, priority p, uint32_t tag = 0);
+        // Runs the statements of tx in one transaction on one connection, see
+        // transaction.hpp. Refused like async_query, then tx is left untouched
+        bool async_transaction(db::transaction&& tx, priority p = priority::normal, uint32_t tag = 0);
+        
+        // Awaitable submission for C++20 coroutines, see task.hpp:
+        //     db::results_t results = co_await pool.query("SELECT ...");
+        // The coroutine is resumed on the loop thread, or through on
+        pending_query query(db::query&& command, executor* on = nullptr);
+        pending_query query(std::string sql, db::query::params_t params = {}, executor* on = nullptr);
+        
+        // Starts COPY ... FROM STDIN on a dedicated connection, e.g.
+        // "COPY users(name, male) FROM STDIN (FORMAT csv)". Producers feed rows
+        // through the returned object and call finish() at the end
+        std::shared_ptr<copy_in> copy_from(const std::string& sql, copy_in::callback_t on_done);
+        // Runs COPY ... TO STDOUT on a dedicated connection and passes every
+        // chunk to sink as it arrives, e.g. copy_out::to_fd(fd)
+        void copy_to(const std::string& sql, copy_out::sink_t sink, copy_out::callback_t on_done);
+        
+        // Calls on_notify for every NOTIFY on channel, through the completion
+        // executor if there is one. The first live loop keeps a dedicated
+        // connection listening on subscribed channels while there are any and
+        // listens again after it was reset or another loop took over,
+        // notifications sent in between are lost
+        uint64_t subscribe(const std::string& channel, listener::callback_t on_notify);
+        void unsubscribe(uint64_t id);
+        
+        // Drops cached results of sql, of every query without sql
+        void invalidate(const std::string& sql);
+        void invalidate();
+        
+        const statement_cache::counters& statement_stats() const;
+        const result_cache::counters& cache_stats() const;
+        const completion_counters& completion_stats() const;
+        // Latency histograms, counters and gauges of the pool
+        metrics::snapshot snapshot() const;
+        // snapshot() together with statement, completion and queue counters
+        // in Prometheus text format
+        std::string prometheus() const;
+        const queue_counters& queue_stats() const;
+        // Connections ready for queries, 0 while the server is unreachable
+        int64_t connected() const;
+        
+        static constexpr std::size_t submit_capacity = 1 << 16;
         
     private:
-        void loop(const connect_param_t& params);
-        std::mutex _mtx_queue;
-        std::list<query> _queue;
-        int _pipefd[2];
-        std::thread _thr;
+        struct shard;
+        
+        void loop(shard& s, const connect_param_t& params);
+        // Moves every submitted query to backlog, returns false if stop was requested
+        bool drain(shard& s);
+        // Takes half of the backlog of the most loaded loop
+        bool steal(shard& thief);
+        // Wakes up a loop which has free connections and nothing to do
+        void wake_hungry(shard& s);
+        // First live loop, it keeps the LISTEN connection. nullptr once all stopped
+        shard* listener_loop();
+        friend class pending_query;
+        
+        // Queues query, on refusal it is left untouched and false is returned
+        bool submit(db::query& query);
+        // Counts one more query against queue_capacity, false if it was refused
+        bool admit();
+        // count queries left the backlog
+        void release(std::size_t count);
+        
+        // Outlive the shards, queries left in them complete on destruction
+        metrics _metrics;
+        std::unique_ptr<worker_pool> _workers;
+        executor* _executor = nullptr;
+        listener _listener;
+        result_cache::counters _cache_stats;
+        std::unique_ptr<result_cache> _own_cache;
+        result_cache* _cache = nullptr;
+        std::vector<std::unique_ptr<shard>> _shards;
         int _size;
+        pool_options _options;
+        statement_cache::counters _statement_stats;
+        queue_counters _queue_stats;
+        // Submitted queries not yet taken by a loop, kept with queue_capacity only
+        std::atomic<std::size_t> _pending{0};
+        std::atomic<int> _blocked{0};
+        std::atomic<bool> _stopping{false};
+        std::mutex _mtx_full;
+        std::condition_variable _cv_full;
+    };
+    
+    // Submits the query when the awaiting coroutine is suspended. Works with
+    // any coroutine handle, so the library itself needs no C++20
+    class pending_query {
+    public:
+        pending_query(connection_pool& pool, db::query&& command, executor* on)
+        : _pool(pool), _command(std::move(command)), _executor(on) {}
+        pending_query(const pending_query&) = delete;
+        
+        bool await_ready() const {
+            return false;
+        }
+        
+        // Not suspended if the pool refused the query, it completes without results
+        template <typename Handle>
+        bool await_suspend(Handle handle) {
+            _resume = [handle]() mutable {
+                handle.resume();
+            };
+            _command.on_done([this](std::list<PGresult*> results) {
+                _results.reserve(results.size());
+                for(auto r: results) {
+                    _results.emplace_back(r);
+                }
+                if (_executor) {
+                    _executor->post(std::move(_resume));
+                }
+                else {
+                    _resume();
+                }
+            });
+            if (!_pool.submit(_command)) {
+                _command.on_done(nullptr);
+                return false;
+            }
+            return true;
+        }
+        
+        // Empty if the query was not executed, e.g. the pool was stopped
+        results_t await_resume() {
+            return std::move(_results);
+        }
+        
+    private:
+        connection_pool& _pool;
+        db::query _command;
+        executor* _executor;
+        executor::task_t _resume;
+        results_t _results;
     };
 }
@@ -0,0 +1,128 @@
+#include "copy_in.hpp"
+#include <cstdlib>
+
+namespace db {
+    
+    int64_t copy_result(const std::list<PGresult*>& results, std::string& error) {
+        int64_t rows = -1;
+        for(auto r: results) {
+            if (PQresultStatus(r) == PGRES_COMMAND_OK) {
+                rows = std::strtoll(PQcmdTuples(r), nullptr, 10);
+            }
+            else if (error.empty()) {
+                error = PQresultErrorMessage(r);
+            }
+            PQclear(r);
+        }
+        if (results.empty()) {
+            error = "copy was not executed";
+        }
+        if (!error.empty()) {
+            rows = -1;
+        }
+        return rows;
+    }
+    
+    copy_in::copy_in(callback_t on_done): _on_done(on_done) {}
+    
+    bool copy_in::write(std::string&& data) {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _cv.wait(lock, [this] {
+            return _done || _finished || _buffered < max_buffered;
+        });
+        if (_done || _finished) {
+            return false;
+        }
+        bool empty = _batches.empty();
+        _buffered += data.size();
+        _batches.push_back(std::move(data));
+        lock.unlock();
+        
+        if (empty) {
+            wake();
+        }
+        return true;
+    }
+    
+    bool copy_in::write(const void* data, std::size_t len) {
+        return write(std::string((const char*)data, len));
+    }
+    
+    void copy_in::finish() {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _finished = true;
+        lock.unlock();
+        wake();
+    }
+    
+    void copy_in::abort(const std::string& reason) {
+        std::unique_lock<std::mutex> lock(_mtx);
+        if (!_finished) {
+            _error = reason.empty() ? "aborted" : reason;
+            _finished = true;
+            // nothing else is sent once copy is aborted
+            _batches.clear();
+            _buffered = 0;
+        }
+        lock.unlock();
+        _cv.notify_all();
+        wake();
+    }
+    
+    void copy_in::attach(std::function<void()> wake) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _wake = wake;
+    }
+    
+    bool copy_in::pop(std::string& data) {
+        std::unique_lock<std::mutex> lock(_mtx);
+        if (_batches.empty()) {
+            return false;
+        }
+        data = std::move(_batches.front());
+        _batches.pop_front();
+        _buffered -= data.size();
+        lock.unlock();
+        _cv.notify_all();
+        return true;
+    }
+    
+    bool copy_in::is_finished() {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _finished && _batches.empty();
+    }
+    
+    const char* copy_in::error() {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _error.empty() ? nullptr : _error.c_str();
+    }
+    
+    void copy_in::complete(const std::list<PGresult*>& results) {
+        std::string error;
+        int64_t rows = copy_result(results, error);
+        
+        std::unique_lock<std::mutex> lock(_mtx);
+        _done = true;
+        _batches.clear();
+        _buffered = 0;
+        _wake = nullptr;
+        lock.unlock();
+        _cv.notify_all();
+        
+        if (_on_done) {
+            _on_done(rows, error);
+            _on_done = nullptr;
+        }
+    }
+    
+    void copy_in::wake() {
+        std::function<void()> wake;
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            wake = _wake;
+        }
+        if (wake) {
+            wake();
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <libpq-fe.h>
+
+namespace db {
+    
+    // Row count of a finished COPY statement, -1 and error on failure. Clears results
+    int64_t copy_result(const std::list<PGresult*>& results, std::string& error);
+    
+    // Producer side of COPY ... FROM STDIN. Producers append batches of rows
+    // already encoded in the COPY format named by the statement (text, csv or binary),
+    // the event loop streams them with PQputCopyData as the socket accepts them.
+    class copy_in {
+    public:
+        // rows is a number of copied rows, -1 on failure
+        using callback_t = std::function<void(int64_t rows, const std::string& error)>;
+        
+        // Producers block in write while this much data waits for the loop
+        static constexpr std::size_t max_buffered = 8 << 20;
+        
+        copy_in(callback_t on_done);
+        copy_in(const copy_in&) = delete;
+        copy_in& operator=(const copy_in&) = delete;
+        
+        // Any thread. Return false if the copy has already completed
+        bool write(std::string&& data);
+        bool write(const void* data, std::size_t len);
+        // No more data, the loop ends copy once the buffer is sent
+        void finish();
+        // Ends copy with an error, server rolls the whole copy back
+        void abort(const std::string& reason);
+        
+        // Loop side
+        void attach(std::function<void()> wake);
+        bool pop(std::string& data);
+        bool is_finished();
+        // nullptr unless aborted
+        const char* error();
+        // Called with the final results of the COPY statement, clears them
+        void complete(const std::list<PGresult*>& results);
+        
+    private:
+        void wake();
+        
+        std::mutex _mtx;
+        std::condition_variable _cv;
+        std::deque<std::string> _batches;
+        std::size_t _buffered = 0;
+        bool _finished = false;
+        bool _done = false;
+        std::string _error;
+        std::function<void()> _wake;
+        callback_t _on_done;
+    };
+}
@@ -0,0 +1,48 @@
+#include "copy_out.hpp"
+#include <cerrno>
+#include <unistd.h>
+
+namespace db {
+    
+    copy_out::copy_out(sink_t sink, callback_t on_done): _sink(sink), _on_done(on_done) {}
+    
+    copy_out::sink_t copy_out::to_fd(int fd) {
+        return [fd](const char* data, std::size_t len) {
+            while (len) {
+                ssize_t n = ::write(fd, data, len);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                data += n;
+                len -= n;
+            }
+            return true;
+        };
+    }
+    
+    void copy_out::write(const char* data, std::size_t len) {
+        _bytes += len;
+        // Once stopped, sink is not called again
+        if (_sink && !_sink(data, len)) {
+            _sink = nullptr;
+        }
+    }
+    
+    void copy_out::complete(const std::list<PGresult*>& results) {
+        std::string error;
+        int64_t rows = copy_result(results, error);
+        
+        if (_on_done) {
+            _on_done(rows, error);
+            _on_done = nullptr;
+        }
+        _sink = nullptr;
+    }
+    
+    uint64_t copy_out::bytes() const {
+        return _bytes;
+    }
+}
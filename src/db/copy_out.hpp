@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <libpq-fe.h>
+#include "copy_in.hpp"
+
+namespace db {
+    
+    // Consumer side of COPY ... TO STDOUT. Every chunk libpq returns is handed
+    // to the sink as is, the event loop never buffers the export.
+    class copy_out {
+    public:
+        // data is valid only during the call. Return false to stop, the rest
+        // of the export is read and discarded
+        using sink_t = std::function<bool(const char* data, std::size_t len)>;
+        // rows is a number of exported rows, -1 on failure
+        using callback_t = copy_in::callback_t;
+        
+        copy_out(sink_t sink, callback_t on_done);
+        copy_out(const copy_out&) = delete;
+        copy_out& operator=(const copy_out&) = delete;
+        
+        // Sink writing every chunk to fd. Writes are blocking and run on
+        // the loop thread, use it for files rather than slow pipes or sockets
+        static sink_t to_fd(int fd);
+        
+        // Loop side
+        void write(const char* data, std::size_t len);
+        // Called with the final results of the COPY statement, clears them
+        void complete(const std::list<PGresult*>& results);
+        uint64_t bytes() const;
+        
+    private:
+        sink_t _sink;
+        callback_t _on_done;
+        uint64_t _bytes = 0;
+    };
+}
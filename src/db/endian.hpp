@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace db {
+    
+    // Network byte order helpers for binary wire format, compile down to a single bswap
+    template <typename T>
+    inline T byte_swap(T value) {
+        static_assert(std::is_integral<T>::value, "integral type expected");
+        if (sizeof(T) == 1) {
+            return value;
+        }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return value;
+#else
+        using U = typename std::make_unsigned<T>::type;
+        U u = (U)value;
+        if (sizeof(T) == 2) {
+            u = (U)__builtin_bswap16((uint16_t)u);
+        }
+        else if (sizeof(T) == 4) {
+            u = (U)__builtin_bswap32((uint32_t)u);
+        }
+        else {
+            u = (U)__builtin_bswap64((uint64_t)u);
+        }
+        return (T)u;
+#endif
+    }
+    
+    template <typename T>
+    inline T load_be(const void* data) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return byte_swap(value);
+    }
+    
+    template <typename T>
+    inline void store_be(void* data, T value) {
+        value = byte_swap(value);
+        std::memcpy(data, &value, sizeof(T));
+    }
+}
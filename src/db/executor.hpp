@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "callback.hpp"
+
+namespace db {
+    
+    // Runs completions somewhere else than on the event loop thread
+    class executor {
+    public:
+        // Big enough for a query handler together with its results and
+        // timestamps, see query::call_handler
+        using task_t = callback<void(), 96>;
+        
+        virtual ~executor() = default;
+        virtual void post(task_t task) = 0;
+    };
+    
+    // How long completion handlers waited for their executor and ran
+    struct completion_counters {
+        std::atomic<uint64_t> handlers{0};
+        std::atomic<uint64_t> queued_ns{0};
+        std::atomic<uint64_t> run_ns{0};
+        std::atomic<uint64_t> max_queued_ns{0};
+        std::atomic<uint64_t> max_run_ns{0};
+        
+        void record(uint64_t queued, uint64_t run) {
+            handlers.fetch_add(1, std::memory_order_relaxed);
+            queued_ns.fetch_add(queued, std::memory_order_relaxed);
+            run_ns.fetch_add(run, std::memory_order_relaxed);
+            raise(max_queued_ns, queued);
+            raise(max_run_ns, run);
+        }
+        
+    private:
+        static void raise(std::atomic<uint64_t>& max, uint64_t value) {
+            uint64_t current = max.load(std::memory_order_relaxed);
+            while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+        }
+    };
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace db {
+
+    // Single threaded queue over a ring of slots which only grows. Popped slots
+    // keep their moved-from elements and are reused, so a queue which has seen
+    // its peak size no longer allocates. Indexes count from the front
+    template <typename T>
+    class fifo {
+    public:
+        bool empty() const {
+            return _count == 0;
+        }
+        std::size_t size() const {
+            return _count;
+        }
+
+        T& operator[](std::size_t i) {
+            return _slots[(_head + i) & (_slots.size() - 1)];
+        }
+        T& front() {
+            return _slots[_head];
+        }
+
+        void push_back(T&& item) {
+            if (_count == _slots.size()) {
+                grow();
+            }
+            (*this)[_count] = std::move(item);
+            ++_count;
+        }
+
+        void pop_front() {
+            _head = (_head + 1) & (_slots.size() - 1);
+            --_count;
+        }
+
+        // Removes [from, to), later elements move up
+        void erase(std::size_t from, std::size_t to) {
+            std::size_t removed = to - from;
+            for (std::size_t i = to; i < _count; ++i) {
+                (*this)[i - removed] = std::move((*this)[i]);
+            }
+            _count -= removed;
+        }
+
+        // Keeps the first count elements
+        void truncate(std::size_t count) {
+            _count = count;
+        }
+
+        void clear() {
+            _head = 0;
+            _count = 0;
+        }
+
+    private:
+        void grow() {
+            // size stays a power of two, so indexes wrap with a mask
+            std::vector<T> slots(_slots.empty() ? 8 : _slots.size() * 2);
+            for (std::size_t i = 0; i < _count; ++i) {
+                slots[i] = std::move((*this)[i]);
+            }
+            _slots.swap(slots);
+            _head = 0;
+        }
+
+        std::vector<T> _slots;
+        std::size_t _head = 0;
+        std::size_t _count = 0;
+    };
+}
@@ -0,0 +1,88 @@
+#include "listener.hpp"
+
+namespace db {
+
+    uint64_t listener::subscribe(const std::string& channel, callback_t on_notify) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        uint64_t id = _next_id++;
+        auto& subscribers = _channels[channel];
+        if (subscribers.empty()) {
+            _changed.store(true, std::memory_order_release);
+        }
+        subscribers[id] = std::make_shared<callback_t>(std::move(on_notify));
+        _active.store(true, std::memory_order_relaxed);
+        return id;
+    }
+
+    bool listener::unsubscribe(uint64_t id) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        for (auto it = _channels.begin(); it != _channels.end(); ++it) {
+            if (it->second.erase(id)) {
+                if (it->second.empty()) {
+                    _channels.erase(it);
+                    _changed.store(true, std::memory_order_release);
+                    _active.store(!_channels.empty(), std::memory_order_relaxed);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool listener::active() const {
+        return _active.load(std::memory_order_relaxed);
+    }
+
+    std::string listener::sync(bool all) {
+        if (!_changed.exchange(false, std::memory_order_acquire) && !all) {
+            return std::string();
+        }
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (all) {
+            _listening.clear();
+        }
+
+        std::string sql;
+        for(auto& channel: _channels) {
+            if (!_listening.count(channel.first)) {
+                sql += "LISTEN " + quote(channel.first) + ";";
+            }
+        }
+        for (auto it = _listening.begin(); it != _listening.end();) {
+            if (!_channels.count(*it)) {
+                sql += "UNLISTEN " + quote(*it) + ";";
+                it = _listening.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        for(auto& channel: _channels) {
+            _listening.insert(channel.first);
+        }
+        return sql;
+    }
+
+    void listener::subscribers(const notification& n, std::vector<std::shared_ptr<callback_t>>& out) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        auto it = _channels.find(n.channel);
+        if (it == _channels.end()) {
+            return;
+        }
+        for(auto& subscriber: it->second) {
+            out.push_back(subscriber.second);
+        }
+    }
+
+    std::string listener::quote(const std::string& channel) {
+        // channel names are identifiers, case is kept
+        std::string quoted = "\"";
+        for(char c: channel) {
+            quoted += c;
+            if (c == '"') {
+                quoted += '"';
+            }
+        }
+        return quoted + "\"";
+    }
+}
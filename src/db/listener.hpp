@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace db {
+
+    struct notification {
+        std::string channel;
+        std::string payload;
+        // server process which sent it
+        int pid = 0;
+    };
+
+    // Subscriptions to LISTEN/NOTIFY channels. connection_pool keeps one
+    // connection listening on every channel which has subscribers
+    class listener {
+    public:
+        using callback_t = std::function<void(const notification& n)>;
+
+        // Any thread. Returns id for unsubscribe
+        uint64_t subscribe(const std::string& channel, callback_t on_notify);
+        // Any thread. Returns false if id is unknown
+        bool unsubscribe(uint64_t id);
+
+        // Loop side, lock-free. True while any channel has subscribers
+        bool active() const;
+        // SQL bringing the server in line with subscriptions, empty if nothing
+        // changed. With all every channel is listened to again, e.g. after reset.
+        // Lock-free unless a channel was added or dropped since the last call
+        std::string sync(bool all);
+        // Subscribers of the notification channel
+        void subscribers(const notification& n, std::vector<std::shared_ptr<callback_t>>& out);
+
+    private:
+        static std::string quote(const std::string& channel);
+
+        std::mutex _mtx;
+        uint64_t _next_id = 1;
+        std::map<std::string, std::map<uint64_t, std::shared_ptr<callback_t>>> _channels;
+        // Channels the server listens to
+        std::set<std::string> _listening;
+        // Set when a channel is added or dropped, taken by sync()
+        std::atomic<bool> _changed{false};
+        // !_channels.empty(), read without the mutex
+        std::atomic<bool> _active{false};
+    };
+}
@@ -0,0 +1,119 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+
+namespace db {
+    
+    uint64_t histogram::upper_bound(int i) {
+        if (i < sub_buckets) {
+            return (uint64_t)i;
+        }
+        int exponent = (i - sub_buckets) / sub_buckets + sub_bits;
+        uint64_t sub = (uint64_t)((i - sub_buckets) % sub_buckets);
+        uint64_t lower = (1ull << exponent) + (sub << (exponent - sub_bits));
+        return lower + (1ull << (exponent - sub_bits)) - 1;
+    }
+    
+    histogram::snapshot histogram::take() const {
+        snapshot s;
+        s.counts.resize(buckets);
+        for (int i = 0; i < buckets; ++i) {
+            s.counts[i] = _counts[i].load(std::memory_order_relaxed);
+            s.count += s.counts[i];
+        }
+        s.sum = _sum.load(std::memory_order_relaxed);
+        return s;
+    }
+    
+    uint64_t histogram::snapshot::percentile(double q) const {
+        if (!count) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q * (double)(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return upper_bound((int)i);
+            }
+        }
+        return upper_bound((int)counts.size() - 1);
+    }
+    
+    double histogram::snapshot::mean() const {
+        return count ? (double)sum / (double)count : 0.0;
+    }
+    
+    metrics::snapshot metrics::take() const {
+        snapshot s;
+        s.queue_wait = queue_wait.take();
+        s.first_byte = first_byte.take();
+        s.total = total.take();
+        s.queries = queries.load(std::memory_order_relaxed);
+        s.errors = errors.load(std::memory_order_relaxed);
+        s.resets = resets.load(std::memory_order_relaxed);
+        s.flush_retries = flush_retries.load(std::memory_order_relaxed);
+        s.busy_connections = busy_connections.load(std::memory_order_relaxed);
+        s.connected_connections = connected_connections.load(std::memory_order_relaxed);
+        return s;
+    }
+    
+    static void append(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+    
+    static void append(std::string& out, const char* format, ...) {
+        char line[256];
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        out.append(line, len < 0 ? 0 : std::min<std::size_t>(len, sizeof(line) - 1));
+    }
+    
+    static void append_histogram(std::string& out, const std::string& name, const char* help,
+                                 const histogram::snapshot& h) {
+        // Fixed Prometheus buckets in seconds, HDR buckets are folded into them
+        static const double bounds[] = {
+            0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+            0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+        };
+        append(out, "# HELP %s %s\n# TYPE %s histogram\n", name.c_str(), help, name.c_str());
+        uint64_t cumulative = 0;
+        std::size_t i = 0;
+        for(double bound: bounds) {
+            uint64_t limit = (uint64_t)(bound * 1e9);
+            while (i < h.counts.size() && histogram::upper_bound((int)i) <= limit) {
+                cumulative += h.counts[i++];
+            }
+            append(out, "%s_bucket{le=\"%g\"} %llu\n", name.c_str(), bound, (unsigned long long)cumulative);
+        }
+        append(out, "%s_bucket{le=\"+Inf\"} %llu\n", name.c_str(), (unsigned long long)h.count);
+        append(out, "%s_sum %.9f\n", name.c_str(), (double)h.sum / 1e9);
+        append(out, "%s_count %llu\n", name.c_str(), (unsigned long long)h.count);
+    }
+    
+    static void append_value(std::string& out, const std::string& name, const char* type, const char* help,
+                             long long value) {
+        append(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name.c_str(), help, name.c_str(), type,
+               name.c_str(), value);
+    }
+    
+    std::string prometheus(const metrics::snapshot& s, const std::string& prefix) {
+        std::string out;
+        append_histogram(out, prefix + "_queue_wait_seconds", "Time from submission to dispatch", s.queue_wait);
+        append_histogram(out, prefix + "_first_byte_seconds", "Time from send to first response bytes", s.first_byte);
+        append_histogram(out, prefix + "_query_seconds", "Time from submission to handler call", s.total);
+        append_value(out, prefix + "_queries_total", "counter", "Completed queries", (long long)s.queries);
+        append_value(out, prefix + "_errors_total", "counter", "Queries completed with an error or without results",
+                     (long long)s.errors);
+        append_value(out, prefix + "_resets_total", "counter", "Connection resets", (long long)s.resets);
+        append_value(out, prefix + "_flush_retries_total", "counter", "PQflush calls which left data unsent",
+                     (long long)s.flush_retries);
+        append_value(out, prefix + "_queue_depth", "gauge", "Queries waiting for a connection", (long long)s.queue_depth);
+        append_value(out, prefix + "_busy_connections", "gauge", "Connections with queries in flight",
+                     (long long)s.busy_connections);
+        append_value(out, prefix + "_connected_connections", "gauge", "Connections ready for queries",
+                     (long long)s.connected_connections);
+        return out;
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "executor.hpp"
+
+namespace db {
+    
+    // Log-linear histogram of nanoseconds in the spirit of HdrHistogram: every
+    // power of two is split into 8 buckets, so a value is off by at most 12.5%.
+    // record() is two relaxed atomic adds, one to the bucket and one to the sum
+    class histogram {
+    public:
+        static constexpr int sub_bits = 3;
+        static constexpr int sub_buckets = 1 << sub_bits;
+        static constexpr int buckets = sub_buckets + (64 - sub_bits) * sub_buckets;
+        
+        struct snapshot {
+            std::vector<uint64_t> counts;
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            
+            // Upper bound of the bucket holding the q-th quantile, q in [0, 1]
+            uint64_t percentile(double q) const;
+            double mean() const;
+        };
+        
+        histogram() {
+            for(auto& c: _counts) {
+                c.store(0, std::memory_order_relaxed);
+            }
+        }
+        
+        void record(uint64_t value) {
+            _counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+            _sum.fetch_add(value, std::memory_order_relaxed);
+        }
+        void record(std::chrono::steady_clock::duration d) {
+            record((uint64_t)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+        }
+        
+        snapshot take() const;
+        
+        static int index(uint64_t value) {
+            if (value < (uint64_t)sub_buckets) {
+                return (int)value;
+            }
+            int exponent = 63 - __builtin_clzll(value);
+            int sub = (int)(value >> (exponent - sub_bits)) & (sub_buckets - 1);
+            return sub_buckets + (exponent - sub_bits) * sub_buckets + sub;
+        }
+        // Largest value falling into bucket i
+        static uint64_t upper_bound(int i);
+        
+    private:
+        std::atomic<uint64_t> _counts[buckets];
+        std::atomic<uint64_t> _sum{0};
+    };
+    
+    // Everything connection_pool and its connections measure
+    class metrics {
+    public:
+        struct snapshot {
+            histogram::snapshot queue_wait;
+            histogram::snapshot first_byte;
+            histogram::snapshot total;
+            uint64_t queries = 0;
+            uint64_t errors = 0;
+            uint64_t resets = 0;
+            uint64_t flush_retries = 0;
+            uint64_t queue_depth = 0;
+            int64_t busy_connections = 0;
+            int64_t connected_connections = 0;
+        };
+        
+        // submission to dispatch on a connection
+        histogram queue_wait;
+        // query sent to first response bytes, sampled per connection
+        histogram first_byte;
+        // submission to handler call
+        histogram total;
+        std::atomic<uint64_t> queries{0};
+        // handlers called without results or with an error result
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> resets{0};
+        // PQflush calls which could not send everything
+        std::atomic<uint64_t> flush_retries{0};
+        std::atomic<int64_t> busy_connections{0};
+        std::atomic<int64_t> connected_connections{0};
+        completion_counters completions;
+        
+        snapshot take() const;
+    };
+    
+    // Prometheus text exposition of s, metric names are prefixed with prefix
+    std::string prometheus(const metrics::snapshot& s, const std::string& prefix = "db");
+}
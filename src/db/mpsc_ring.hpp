@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace db {
+    
+    // Bounded lock-free multi-producer/single-consumer ring buffer.
+    // Every cell carries a sequence number (D. Vyukov's bounded queue), producers
+    // claim a slot with one CAS on the head, the consumer needs no atomic RMW at all.
+    template <typename T>
+    class mpsc_ring {
+    public:
+        // capacity is rounded up to power of two
+        explicit mpsc_ring(std::size_t capacity) {
+            std::size_t size = 2;
+            while (size < capacity) {
+                size <<= 1;
+            }
+            _mask = size - 1;
+            _cells.reset(new cell[size]);
+            for (std::size_t i = 0; i < size; ++i) {
+                _cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+        mpsc_ring(const mpsc_ring&) = delete;
+        mpsc_ring& operator=(const mpsc_ring&) = delete;
+        
+        // Any thread. Returns false if the ring is full, value is left untouched
+        bool push(T&& value) {
+            std::size_t pos = _head.load(std::memory_order_relaxed);
+            cell* c;
+            while (true) {
+                c = &_cells[pos & _mask];
+                std::size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;
+                }
+                else {
+                    pos = _head.load(std::memory_order_relaxed);
+                }
+            }
+            c->value = std::move(value);
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+        
+        // Consumer thread only. Returns false if the ring is empty
+        bool pop(T& value) {
+            cell* c = &_cells[_tail & _mask];
+            std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            if ((intptr_t)seq - (intptr_t)(_tail + 1) < 0) {
+                return false;
+            }
+            value = std::move(c->value);
+            c->sequence.store(_tail + _mask + 1, std::memory_order_release);
+            ++_tail;
+            return true;
+        }
+        
+        // Consumer thread only. Moves up to max published values into consumer
+        template <typename F>
+        std::size_t drain(F&& consumer, std::size_t max = SIZE_MAX) {
+            std::size_t count = 0;
+            while (count < max) {
+                cell* c = &_cells[_tail & _mask];
+                std::size_t seq = c->sequence.load(std::memory_order_acquire);
+                if ((intptr_t)seq - (intptr_t)(_tail + 1) < 0) {
+                    break;
+                }
+                consumer(std::move(c->value));
+                c->sequence.store(_tail + _mask + 1, std::memory_order_release);
+                ++_tail;
+                ++count;
+            }
+            return count;
+        }
+        
+        std::size_t capacity() const {
+            return _mask + 1;
+        }
+        
+    private:
+        struct cell {
+            std::atomic<std::size_t> sequence;
+            T value;
+        };
+        
+        std::unique_ptr<cell[]> _cells;
+        std::size_t _mask;
+        alignas(64) std::atomic<std::size_t> _head{0};
+        alignas(64) std::size_t _tail = 0;
+    };
+}
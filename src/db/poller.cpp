@@ -0,0 +1,82 @@
+#include "poller.hpp"
+#include <cerrno>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace db {
+    
+    static uint32_t to_epoll(uint32_t events) {
+        uint32_t ev = 0;
+        if (events & poller::read) {
+            ev |= EPOLLIN;
+        }
+        if (events & poller::write) {
+            ev |= EPOLLOUT;
+        }
+        return ev;
+    }
+    
+    poller::poller(int max_events): _ready(max_events) {
+        _epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (_epfd == -1) {
+            throw std::runtime_error("failed to create epoll instance");
+        }
+    }
+    
+    poller::~poller() {
+        if (_epfd != -1) {
+            close(_epfd);
+        }
+    }
+    
+    bool poller::add(int fd, uint32_t events, void* data) {
+        epoll_event ev = {};
+        ev.events = to_epoll(events);
+        ev.data.ptr = data;
+        if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+            return true;
+        }
+        // fd is already registered (e.g. reused descriptor number)
+        return errno == EEXIST && epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+    
+    bool poller::modify(int fd, uint32_t events, void* data) {
+        epoll_event ev = {};
+        ev.events = to_epoll(events);
+        ev.data.ptr = data;
+        if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+            return true;
+        }
+        // closing a socket silently drops it from epoll, libpq may reopen
+        // a socket with the same number on reset
+        return errno == ENOENT && epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    
+    bool poller::remove(int fd) {
+        return epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr) == 0;
+    }
+    
+    int poller::wait(int timeout_ms) {
+        int n;
+        do {
+            n = epoll_wait(_epfd, _ready.data(), (int)_ready.size(), timeout_ms);
+        } while (n == -1 && errno == EINTR);
+        return n;
+    }
+    
+    void* poller::data(int idx) const {
+        return _ready[idx].data.ptr;
+    }
+    
+    uint32_t poller::events(int idx) const {
+        uint32_t ev = _ready[idx].events;
+        uint32_t result = none;
+        if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            result |= read;
+        }
+        if (ev & (EPOLLOUT | EPOLLERR)) {
+            result |= write;
+        }
+        return result;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <sys/epoll.h>
+
+namespace db {
+    
+    // Thin wrapper over epoll. Sockets are registered once and only re-armed
+    // when their interest changes, so a wakeup costs O(ready sockets).
+    class poller {
+    public:
+        enum event : uint32_t {
+            none = 0,
+            read = 1,
+            write = 2
+        };
+        
+        poller(int max_events = 64);
+        poller(const poller&) = delete;
+        ~poller();
+        
+        poller& operator=(const poller&) = delete;
+        
+        bool add(int fd, uint32_t events, void* data);
+        bool modify(int fd, uint32_t events, void* data);
+        bool remove(int fd);
+        
+        // Returns number of ready entries, 0 on timeout, -1 on error
+        int wait(int timeout_ms);
+        void* data(int idx) const;
+        uint32_t events(int idx) const;
+        
+    private:
+        int _epfd = -1;
+        std::vector<epoll_event> _ready;
+    };
+}
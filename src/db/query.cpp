@@ -1,4 +1,10 @@
 #include "query.hpp"
+#include "transaction.hpp"
+#include <cctype>
+#include <cstring>
+#include <initializer_list>
+#include <strings.h>
+#include <chrono>
 
 namespace db {
 
@@ -10,30 +16,54 @@ namespace db {
     
     query::query(const std::string& sql, callback_t handler) {
         _sql = sql;
-        _handler = handler;
+        _handler = std::move(handler);
     }
     
     query::query(std::string&& sql, callback_t handler) {
         _sql = std::move(sql);
-        _handler = handler;
+        _handler = std::move(handler);
     }
     
-    query::query(const std::string& sql, const std::list<param>& params, callback_t handler) {
+    query::query(const std::string& sql, const params_t& params, callback_t handler) {
         _sql = sql;
         _params = params;
-        _handler = handler;
+        _handler = std::move(handler);
     }
     
-    query::query(const std::string& sql, std::list<param>&& params, callback_t handler) {
+    query::query(const std::string& sql, params_t&& params, callback_t handler) {
         _sql = sql;
         _params = std::move(params);
-        _handler = handler;
+        _handler = std::move(handler);
     }
     
-    query::query(std::string&& sql, std::list<param>&& params, callback_t handler) {
+    query::query(std::string&& sql, params_t&& params, callback_t handler) {
         _sql = std::move(sql);
         _params = std::move(params);
-        _handler = handler;
+        _handler = std::move(handler);
+    }
+    
+    query::query(const std::string& sql, std::shared_ptr<copy_in> copy) {
+        _sql = sql;
+        _copy = copy;
+        _handler = [copy](std::list<PGresult*> results) {
+            copy->complete(results);
+        };
+    }
+    
+    query::query(const std::string& sql, std::shared_ptr<copy_out> sink) {
+        _sql = sql;
+        _sink = sink;
+        _handler = [sink](std::list<PGresult*> results) {
+            sink->complete(results);
+        };
+    }
+    
+    query::query(const std::string& sql, std::shared_ptr<db::transaction> tx) {
+        _sql = sql;
+        _transaction = tx;
+        _handler = [tx](std::list<PGresult*> results) {
+            tx->complete(results);
+        };
     }
     
     query::~query() {
@@ -43,8 +73,49 @@ namespace db {
     query& query::operator=(query&& other) {
         _sql = std::move(other._sql);
         _params = std::move(other._params);
-        _handler = other._handler;
-        other._handler = nullptr;
+        _handler = std::move(other._handler);
+        _on_rows = std::move(other._on_rows);
+        _chunk_rows = other._chunk_rows;
+        other._chunk_rows = 0;
+        _binary_results = other._binary_results;
+        _access = other._access;
+        _cache_ttl = other._cache_ttl;
+        _priority = other._priority;
+        _tag = other._tag;
+        _enqueued = other._enqueued;
+        _executor = other._executor;
+        _metrics = other._metrics;
+        _copy = std::move(other._copy);
+        _sink = std::move(other._sink);
+        _transaction = std::move(other._transaction);
+        return *this;
+    }
+    
+    query& query::stream(rows_callback_t on_rows, int chunk_rows) {
+        _on_rows = std::move(on_rows);
+        _chunk_rows = chunk_rows < 1 ? 1 : chunk_rows;
+        return *this;
+    }
+    
+    query& query::on_done(callback_t handler) {
+        _handler = std::move(handler);
+        return *this;
+    }
+    
+    query& query::complete_on(executor* on, metrics* stats) {
+        _executor = on;
+        _metrics = stats;
+        return *this;
+    }
+    
+    query& query::schedule(db::priority p, uint32_t tag) {
+        _priority = p;
+        _tag = tag;
+        return *this;
+    }
+    
+    query& query::binary_results(bool binary) {
+        _binary_results = binary;
         return *this;
     }
     
@@ -56,15 +127,185 @@ namespace db {
         return _sql;
     }
     
-    const std::list<query::param>& query::params() const {
+    const query::params_t& query::params() const {
         return _params;
     }
     
-    void query::call_handler(const std::list<PGresult*>& results) {
+    bool query::is_streaming() const {
+        return _chunk_rows > 0;
+    }
+    
+    int query::chunk_rows() const {
+        return _chunk_rows;
+    }
+    
+    bool query::is_binary_results() const {
+        return _binary_results;
+    }
+    
+    query& query::read_only(bool on) {
+        _access = on ? access::read : access::write;
+        return *this;
+    }
+    
+    query& query::cache_for(std::chrono::milliseconds ttl) {
+        _cache_ttl = ttl;
+        return *this;
+    }
+    
+    std::chrono::milliseconds query::cache_ttl() const {
+        return _cache_ttl;
+    }
+    
+    // Case insensitive search for words separated by any whitespace, none of
+    // them preceded or followed by a letter
+    static bool has_words(const std::string& sql, std::initializer_list<const char*> words) {
+        auto letter = [](char c) {
+            return std::isalnum((unsigned char)c) || c == '_';
+        };
+        for (std::size_t start = 0; start < sql.size(); ++start) {
+            if (start > 0 && letter(sql[start - 1])) {
+                continue;
+            }
+            std::size_t pos = start;
+            bool found = true;
+            for(auto word: words) {
+                if (pos != start) {
+                    std::size_t gap = pos;
+                    while (pos < sql.size() && std::isspace((unsigned char)sql[pos])) {
+                        ++pos;
+                    }
+                    if (pos == gap) {
+                        found = false;
+                        break;
+                    }
+                }
+                std::size_t len = std::strlen(word);
+                if (pos + len > sql.size() || strncasecmp(sql.c_str() + pos, word, len) != 0 ||
+                    (pos + len < sql.size() && letter(sql[pos + len]))) {
+                    found = false;
+                    break;
+                }
+                pos += len;
+            }
+            if (found) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    bool query::is_read_only() const {
+        if (_access != access::detect) {
+            return _access == access::read;
+        }
+        if (is_exclusive()) {
+            return false;
+        }
+        // Plain SELECT, without row locks or SELECT INTO
+        std::size_t begin = _sql.find_first_not_of(" \t\r\n(");
+        if (begin == std::string::npos || strncasecmp(_sql.c_str() + begin, "SELECT", 6) != 0 ||
+            (begin + 6 < _sql.size() && (std::isalnum((unsigned char)_sql[begin + 6]) || _sql[begin + 6] == '_'))) {
+            return false;
+        }
+        return !has_words(_sql, {"FOR", "UPDATE"}) && !has_words(_sql, {"FOR", "NO", "KEY", "UPDATE"}) &&
+               !has_words(_sql, {"FOR", "SHARE"}) && !has_words(_sql, {"FOR", "KEY", "SHARE"}) &&
+               !has_words(_sql, {"INTO"});
+    }
+    
+    std::chrono::steady_clock::time_point query::enqueued() const {
+        return _enqueued;
+    }
+    
+    void query::set_enqueued(std::chrono::steady_clock::time_point time) {
+        _enqueued = time;
+    }
+    
+    priority query::priority() const {
+        return _priority;
+    }
+    
+    uint32_t query::tag() const {
+        return _tag;
+    }
+    
+    const std::shared_ptr<copy_in>& query::copy() const {
+        return _copy;
+    }
+    
+    const std::shared_ptr<copy_out>& query::sink() const {
+        return _sink;
+    }
+    
+    bool query::is_copy() const {
+        return _copy || _sink;
+    }
+    
+    const std::shared_ptr<transaction>& query::transaction() const {
+        return _transaction;
+    }
+    
+    bool query::is_exclusive() const {
+        return is_copy() || _transaction;
+    }
+    
+    bool query::call_rows(const PGresult* rows) {
+        // Once stopped, stream is not resumed
+        if (_on_rows && !_on_rows(rows)) {
+            _on_rows = nullptr;
+        }
+        return (bool)_on_rows;
+    }
+    
+    query::callback_t query::take_handler() {
+        return std::move(_handler);
+    }
+    
+    void query::call_handler(std::list<PGresult*> results) {
         // Guarantee, that handler will be called once
-        if (_handler) {
-            _handler(results);
-            _handler = nullptr;
+        if (!_handler) {
+            return;
+        }
+        callback_t handler = std::move(_handler);
+        _handler = nullptr;
+        if (!_executor && !_metrics) {
+            handler(std::move(results));
+            return;
+        }
+        
+        using clock = std::chrono::steady_clock;
+        auto queued = clock::now();
+        if (_metrics) {
+            bool failed = results.empty();
+            for(auto r: results) {
+                ExecStatusType status = PQresultStatus(r);
+                failed = failed || status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE ||
+                         status == PGRES_PIPELINE_ABORTED;
+            }
+            _metrics->queries.fetch_add(1, std::memory_order_relaxed);
+            if (failed) {
+                _metrics->errors.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        auto run = [handler = std::move(handler), results = std::move(results), stats = _metrics, queued,
+                    enqueued = _enqueued]() mutable {
+            auto started = clock::now();
+            if (stats) {
+                stats->total.record(started - enqueued);
+            }
+            handler(std::move(results));
+            if (stats) {
+                auto finished = clock::now();
+                stats->completions.record(std::chrono::duration_cast<std::chrono::nanoseconds>(started - queued).count(),
+                              std::chrono::duration_cast<std::chrono::nanoseconds>(finished - started).count());
+            }
+        };
+        static_assert(sizeof(run) <= executor::task_t::inline_size, "completion must not allocate");
+        if (_executor) {
+            _executor->post(std::move(run));
+        }
+        else {
+            run();
         }
     }
     
@@ -98,9 +339,10 @@ namespace db {
         param p(number, size, true, true);
         if (is_le()) {
             // convert to big endiann
+            unsigned char* data = (unsigned char*)p.data();
             std::size_t half_size = size / 2;
             for (int i = 0; i < half_size; ++i) {
-                std::swap(p._data[i], p._data[size - i - 1]);
+                std::swap(data[i], data[size - i - 1]);
             }
         }
         return p;
@@ -130,17 +372,31 @@ namespace db {
         return param::number(&number, 8);
     }
     
+    query::param query::param::typed(const void* data, std::size_t len, Oid oid) {
+        param p((void*)data, len, true, true);
+        p._oid = oid;
+        return p;
+    }
+    
+    query::param query::param::null(Oid oid) {
+        param p(nullptr, 0, true);
+        p._oid = oid;
+        return p;
+    }
+    
     query::param::param(void* data, std::size_t len, bool binary, bool copy) {
         _len = len;
         _binary = binary;
-        if (copy) {
+        _owner = copy;
+        if (is_inline()) {
+            std::memcpy(_inline, data, _len);
+        }
+        else if (copy) {
             _data = new unsigned char[_len];
             std::memcpy(_data, data, _len);
-            _owner = true;
         }
         else {
             _data = reinterpret_cast<unsigned char*>(data);
-            _owner = false;
         }
     }
 
@@ -153,10 +409,18 @@ namespace db {
     }
     
     query::param& query::param::operator=(const param& other) {
+        if (this == &other) {
+            return *this;
+        }
+        release();
         _len = other._len;
+        _oid = other._oid;
         _binary = other._binary;
         _owner = other._owner;
-        if (_owner) {
+        if (is_inline()) {
+            std::memcpy(_inline, other._inline, _len);
+        }
+        else if (_owner) {
             _data = new unsigned char[_len];
             std::memcpy(_data, other._data, _len);
         }
@@ -167,10 +431,20 @@ namespace db {
     }
     
     query::param& query::param::operator=(param&& other) {
+        if (this == &other) {
+            return *this;
+        }
+        release();
         _len = other._len;
+        _oid = other._oid;
         _binary = other._binary;
         _owner = other._owner;
-        _data = other._data;
+        if (is_inline()) {
+            std::memcpy(_inline, other._inline, _len);
+        }
+        else {
+            _data = other._data;
+        }
         other._data = nullptr;
         other._len = 0;
         other._owner = false;
@@ -178,9 +452,15 @@ namespace db {
     }
 
     query::param::~param() {
-        if (_owner && _data) {
+        release();
+    }
+    
+    void query::param::release() {
+        if (_owner && !is_inline() && _data) {
             delete[] _data;
         }
+        _data = nullptr;
+        _owner = false;
     }
 
 }
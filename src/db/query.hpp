@@ -1,77 +1,183 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <string>
 #include <list>
+#include <memory>
+#include <functional>
 #include <system_error>
 #include <libpq-fe.h>
+#include "callback.hpp"
+#include "executor.hpp"
+#include "metrics.hpp"
+#include "small_vector.hpp"
+#include "copy_in.hpp"
+#include "copy_out.hpp"
 
 namespace db {
     
+    class transaction;
+    
+    // Scheduling class, higher ones are always dispatched first
+    enum class priority : uint8_t {
+        high,
+        normal,
+        low
+    };
+
     class query {
     public:
-        class param;
-        using callback_t = std::function<void(std::list<PGresult*>)>;
+        class param {
+        public:
+            param(void* data, std::size_t len, bool binary, bool copy = false);
+            param(const param& other);
+            param(param&& other);
+            ~param();
+            
+            param& operator=(const param& other);
+            param& operator=(param&& other);
+            
+            static param boolean(bool boolVal);
+            static param text(const std::string& strVal);
+            static param number(void* number, std::size_t size);
+            static param int16(int16_t number);
+            static param int32(int32_t number);
+            static param int64(int64_t number);
+            static param uint16(uint16_t number);
+            static param uint32(uint32_t number);
+            static param uint64(uint64_t number);
+            // Owned binary value of the given type, see bind.hpp
+            static param typed(const void* data, std::size_t len, Oid oid);
+            static param null(Oid oid = 0);
+            
+            const void* data() const {
+                return is_inline() ? _inline : _data;
+            }
+            std::size_t len() const {
+                return _len;
+            }
+            bool is_binary() const {
+                return _binary;
+            }
+            // 0 lets the server infer the type
+            Oid oid() const {
+                return _oid;
+            }
+            
+            // Owned values up to this size are kept inside the param
+            static constexpr std::size_t inline_size = 16;
+        
+        private:
+            bool is_inline() const {
+                return _owner && _len <= inline_size;
+            }
+            void release();
+            
+            union {
+                unsigned char* _data = nullptr;
+                unsigned char _inline[inline_size];
+            };
+            std::size_t _len = 0;
+            Oid _oid = 0;
+            bool _binary = false;
+            bool _owner = false;
+        };
+        
+        using callback_t = callback<void(std::list<PGresult*>)>;
+        // Receives rows as they arrive, result is cleared after the call.
+        // Return false to stop the stream, remaining rows are discarded
+        using rows_callback_t = callback<bool(const PGresult*)>;
+        // Up to 4 params are stored inside the query
+        using params_t = small_vector<param, 4>;
         
         query();
         query(query&& other);
         query(const query& other) = delete;
         query(const std::string& sql, callback_t handler);
         query(std::string&& sql, callback_t handler);
-        query(const std::string& sql, const std::list<param>& params, callback_t handler);
-        query(const std::string& sql, std::list<param>&& params, callback_t handler);
-        query(std::string&& sql, std::list<param>&& params, callback_t handler);
+        query(const std::string& sql, const params_t& params, callback_t handler);
+        query(const std::string& sql, params_t&& params, callback_t handler);
+        query(std::string&& sql, params_t&& params, callback_t handler);
+        // COPY ... FROM STDIN fed from copy, completion is reported through copy
+        query(const std::string& sql, std::shared_ptr<copy_in> copy);
+        // COPY ... TO STDOUT drained into sink, completion is reported through sink
+        query(const std::string& sql, std::shared_ptr<copy_out> sink);
+        // Runs the statements of tx after sql, which begins the transaction,
+        // completion is reported through tx
+        query(const std::string& sql, std::shared_ptr<db::transaction> tx);
         ~query();
         
         query& operator=(const query& other) = delete;
         query& operator=(query&& other);
         
+        // Deliver rows in chunks of chunk_rows (single row mode if libpq has no
+        // chunked mode) instead of buffering the whole result. The handler then
+        // gets only the final result without rows or an error
+        query& stream(rows_callback_t on_rows, int chunk_rows = 1);
+        // Replaces the handler
+        query& on_done(callback_t handler);
+        // Run the handler through on (inline if nullptr) and account the query in stats.
+        // Set by connection_pool, rows callbacks always run on the loop thread
+        query& complete_on(executor* on, metrics* stats);
+        // Priority class and tenant tag, tags of one class share connections by weight
+        query& schedule(db::priority p, uint32_t tag = 0);
+        // Ask the server for results in binary format, see result::rows()
+        query& binary_results(bool binary = true);
+        // Lets replicated_pool run the query on a replica. Without it only plain
+        // SELECTs go there, read_only(false) keeps one on the primary, e.g. if
+        // it calls a function with side effects
+        query& read_only(bool on = true);
+        // Lets a pool with pool_options::result_cache answer the same SQL with
+        // the same params from memory for ttl after a successful execution.
+        // A hit gets copies of the columns, rows and command tag, so
+        // PQcmdStatus() and PQcmdTuples() read as for the original results
+        query& cache_for(std::chrono::milliseconds ttl);
+        
         bool empty() const;
         const std::string& sql() const;
-        const std::list<param>& params() const;
-        void call_handler(const std::list<PGresult*>& results);
-        
+        const params_t& params() const;
+        bool is_streaming() const;
+        int chunk_rows() const;
+        bool is_binary_results() const;
+        bool is_read_only() const;
+        std::chrono::milliseconds cache_ttl() const;
+        // When the query was submitted to the pool
+        std::chrono::steady_clock::time_point enqueued() const;
+        void set_enqueued(std::chrono::steady_clock::time_point time);
+        db::priority priority() const;
+        uint32_t tag() const;
+        const std::shared_ptr<copy_in>& copy() const;
+        const std::shared_ptr<copy_out>& sink() const;
+        bool is_copy() const;
+        const std::shared_ptr<db::transaction>& transaction() const;
+        // Needs a connection without queries in flight, COPY or transaction
+        bool is_exclusive() const;
+        // Handler set so far, the query is left without one
+        callback_t take_handler();
+        void call_handler(std::list<PGresult*> results);
+        bool call_rows(const PGresult* rows);
+    
     private:
         std::string _sql;
-        std::list<param> _params;
+        params_t _params;
         callback_t _handler;
-    };
-
-    class query::param {
-    public:
-        param(void* data, std::size_t len, bool binary, bool copy = false);
-        param(const param& other);
-        param(param&& other);
-        ~param();
-        
-        param& operator=(const param& other);
-        param& operator=(param&& other);
-        
-        static param boolean(bool boolVal);
-        static param text(const std::string& strVal);
-        static param number(void* number, std::size_t size);
-        static param int16(int16_t number);
-        static param int32(int32_t number);
-        static param int64(int64_t number);
-        static param uint16(uint16_t number);
-        static param uint32(uint32_t number);
-        static param uint64(uint64_t number);
-        
-        const void* data() const {
-            return _data;
-        }
-        std::size_t len() const {
-            return _len;
-        }
-        bool is_binary() const {
-            return _binary;
-        }
-        
-    private:
-        unsigned char* _data = nullptr;
-        std::size_t _len = 0;
-        bool _binary = false;
-        bool _owner = false;
+        rows_callback_t _on_rows;
+        int _chunk_rows = 0;
+        bool _binary_results = false;
+        enum class access : uint8_t {
+            detect, read, write
+        };
+        access _access = access::detect;
+        std::chrono::milliseconds _cache_ttl{0};
+        db::priority _priority = db::priority::normal;
+        uint32_t _tag = 0;
+        std::chrono::steady_clock::time_point _enqueued;
+        executor* _executor = nullptr;
+        metrics* _metrics = nullptr;
+        std::shared_ptr<copy_in> _copy;
+        std::shared_ptr<copy_out> _sink;
+        std::shared_ptr<db::transaction> _transaction;
     };
 
 }
@@ -0,0 +1,180 @@
+#include "replicated_pool.hpp"
+#include "../logger/logger.hpp"
+#include <algorithm>
+
+namespace db {
+
+    using clock = std::chrono::steady_clock;
+
+    struct replicated_pool::replica_group {
+        replica_group(std::size_t id, int size, const pool_options& options, const replica_options& health)
+        : id(id), health(health), pool(size, options) {}
+
+        bool healthy() const {
+            return pool.connected() > 0 && clock::now().time_since_epoch().count() >= down_until.load(std::memory_order_relaxed);
+        }
+
+        // Expected wait for one more query
+        int64_t score() const {
+            int64_t latency = std::max<int64_t>(1000, latency_ns.load(std::memory_order_relaxed));
+            return (outstanding.load(std::memory_order_relaxed) + 1) * latency;
+        }
+
+        void done(clock::duration took, bool lost) {
+            outstanding.fetch_sub(1, std::memory_order_relaxed);
+            if (lost) {
+                auto now = clock::now();
+                if (failures.fetch_add(1, std::memory_order_relaxed) + 1 >= health.failures &&
+                    now.time_since_epoch().count() >= down_until.load(std::memory_order_relaxed)) {
+                    log_error("[db] replica[%d] failing, reads go elsewhere for %lld ms",
+                              (int)id, (long long)health.cooldown.count());
+                    down_until.store((now + health.cooldown).time_since_epoch().count(), std::memory_order_relaxed);
+                    failures.store(0, std::memory_order_relaxed);
+                }
+                return;
+            }
+            failures.store(0, std::memory_order_relaxed);
+            // Moving average over roughly the last 8 queries, updates racing
+            // between loops only lose a sample
+            int64_t sample = std::chrono::duration_cast<std::chrono::nanoseconds>(took).count();
+            int64_t average = latency_ns.load(std::memory_order_relaxed);
+            latency_ns.store(average ? average + (sample - average) / 8 : sample, std::memory_order_relaxed);
+        }
+
+        std::size_t id;
+        replica_options health;
+        std::atomic<int64_t> outstanding{0};
+        std::atomic<int64_t> latency_ns{0};
+        std::atomic<int> failures{0};
+        std::atomic<clock::rep> down_until{0};
+        // Destroyed first, queries left in it complete while the counters above exist
+        connection_pool pool;
+    };
+
+    static pool_options replica_pool_options(pool_options options) {
+        options.on_full = overflow::reject;
+        return options;
+    }
+
+    replicated_pool::replicated_pool(int size, std::size_t replicas, const pool_options& options,
+                                     const replica_options& health) {
+        // One set of completion workers and one cache budget for all pools
+        pool_options shared = options;
+        if (!shared.completions && shared.completion_threads > 0) {
+            _workers.reset(new worker_pool(shared.completion_threads));
+            shared.completions = _workers.get();
+        }
+        shared.completion_threads = 0;
+        if (!shared.cache && shared.result_cache > 0) {
+            _cache.reset(new result_cache(shared.result_cache, &_cache_stats));
+            shared.cache = _cache.get();
+        }
+        shared.result_cache = 0;
+
+        _primary.reset(new connection_pool(size, shared));
+        for (std::size_t i = 0; i < replicas; ++i) {
+            _replicas.emplace_back(new replica_group(i, size, replica_pool_options(shared), health));
+        }
+    }
+
+    replicated_pool::~replicated_pool() {}
+
+    void replicated_pool::run(const connect_param_t& primary, const std::vector<connect_param_t>& replicas) {
+        if (replicas.size() != _replicas.size()) {
+            log_error("[db] %d replicas configured, %d connection parameters given",
+                      (int)_replicas.size(), (int)replicas.size());
+        }
+        _primary->run(primary);
+        for (std::size_t i = 0; i < _replicas.size() && i < replicas.size(); ++i) {
+            _replicas[i]->pool.run(replicas[i]);
+        }
+    }
+
+    void replicated_pool::stop() {
+        _primary->stop();
+        for(auto& r: _replicas) {
+            r->pool.stop();
+        }
+        // Every handler has run once stop returns
+        if (_workers) {
+            _workers->stop();
+        }
+    }
+
+    void replicated_pool::invalidate(const std::string& sql) {
+        _primary->invalidate(sql);
+    }
+
+    void replicated_pool::invalidate() {
+        _primary->invalidate();
+    }
+
+    const result_cache::counters& replicated_pool::cache_stats() const {
+        return _cache_stats;
+    }
+
+    replicated_pool::replica_group* replicated_pool::pick() {
+        replica_group* best = nullptr;
+        int64_t best_score = 0;
+        for(auto& r: _replicas) {
+            if (!r->healthy()) {
+                continue;
+            }
+            int64_t score = r->score();
+            if (!best || score < best_score) {
+                best = r.get();
+                best_score = score;
+            }
+        }
+        return best;
+    }
+
+    bool replicated_pool::async_query(db::query&& query) {
+        replica_group* r = query.is_read_only() ? pick() : nullptr;
+        if (!r) {
+            return _primary->async_query(std::move(query));
+        }
+
+        // Kept outside the wrapper, so a refused query gets its handler back
+        auto handler = std::make_shared<query::callback_t>(query.take_handler());
+        query.on_done([r, handler, sent = clock::now()](std::list<PGresult*> results) {
+            r->done(clock::now() - sent, results.empty());
+            if (*handler) {
+                (*handler)(std::move(results));
+            }
+            else {
+                for(auto res: results) {
+                    PQclear(res);
+                }
+            }
+        });
+        r->outstanding.fetch_add(1, std::memory_order_relaxed);
+        if (r->pool.async_query(std::move(query))) {
+            return true;
+        }
+        r->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        query.on_done(std::move(*handler));
+        return _primary->async_query(std::move(query));
+    }
+
+    bool replicated_pool::async_query(db::query&& query, priority p, uint32_t tag) {
+        query.schedule(p, tag);
+        return async_query(std::move(query));
+    }
+
+    bool replicated_pool::async_transaction(db::transaction&& tx, priority p, uint32_t tag) {
+        return _primary->async_transaction(std::move(tx), p, tag);
+    }
+
+    connection_pool& replicated_pool::primary() {
+        return *_primary;
+    }
+
+    connection_pool& replicated_pool::replica(std::size_t i) {
+        return _replicas[i]->pool;
+    }
+
+    std::size_t replicated_pool::replicas() const {
+        return _replicas.size();
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "connection_pool.hpp"
+
+namespace db {
+
+    struct replica_options {
+        // A replica whose queries failed without results failures times in a row,
+        // e.g. its connections were lost, gets no reads for cooldown
+        int failures = 3;
+        std::chrono::milliseconds cooldown{1000};
+    };
+
+    // Connection pools for one primary and N replicas. Read-only queries, see
+    // query::read_only(), go to the replica expected to answer first judging by
+    // queries in flight and recent latency, everything else to the primary.
+    // A replica is healthy while it has connections and its queries do not keep
+    // failing. Reads fall back to the primary while no replica is healthy or the
+    // chosen one is full, reads already queued at a replica wait for it like on
+    // any pool. Replication lag is not looked at, reads which must see
+    // a preceding write belong on the primary.
+    // completion_threads and result_cache of options are set up once and
+    // shared by the primary and every replica
+    class replicated_pool {
+    public:
+        // size connections to the primary and to every replica, replicas
+        // refuse queries instead of blocking, see pool_options::on_full
+        replicated_pool(int size, std::size_t replicas, const pool_options& options = pool_options(),
+                        const replica_options& health = replica_options());
+        ~replicated_pool();
+        void run(const connect_param_t& primary, const std::vector<connect_param_t>& replicas);
+        void stop();
+
+        bool async_query(db::query&& query);
+        bool async_query(db::query&& query, priority p, uint32_t tag = 0);
+        // Transactions, COPY and subscriptions always use the primary
+        bool async_transaction(db::transaction&& tx, priority p = priority::normal, uint32_t tag = 0);
+
+        // Drops cached results of sql, of every query without sql
+        void invalidate(const std::string& sql);
+        void invalidate();
+        // Counters of the cache set up from pool_options::result_cache
+        const result_cache::counters& cache_stats() const;
+
+        connection_pool& primary();
+        connection_pool& replica(std::size_t i);
+        std::size_t replicas() const;
+
+    private:
+        struct replica_group;
+
+        // Least loaded healthy replica, nullptr if there is none
+        replica_group* pick();
+
+        // Shared by all pools, so they outlive them
+        std::unique_ptr<worker_pool> _workers;
+        result_cache::counters _cache_stats;
+        std::unique_ptr<result_cache> _cache;
+        std::unique_ptr<connection_pool> _primary;
+        std::vector<std::unique_ptr<replica_group>> _replicas;
+    };
+}
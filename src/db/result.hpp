@@ -0,0 +1,236 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include <libpq-fe.h>
+#include "callback.hpp"
+#include "endian.hpp"
+
+namespace db {
+    
+    // Decodes one field, binary columns are read as big-endian wire values,
+    // text columns are parsed. NULL becomes T{} unless T is std::optional
+    template <typename T, typename Enable = void>
+    struct field;
+    
+    template <typename T>
+    struct field<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+        static T decode(const char* data, int len, bool binary) {
+            if (binary) {
+                switch (len) {
+                    case 2: return (T)load_be<int16_t>(data);
+                    case 4: return (T)load_be<int32_t>(data);
+                    case 8: return (T)load_be<int64_t>(data);
+                    default: return T();
+                }
+            }
+            T value = T();
+            std::from_chars(data, data + len, value);
+            return value;
+        }
+    };
+    
+    template <>
+    struct field<bool> {
+        static bool decode(const char* data, int len, bool binary) {
+            if (binary) {
+                return len > 0 && data[0] != 0;
+            }
+            return len > 0 && data[0] == 't';
+        }
+    };
+    
+    template <>
+    struct field<float> {
+        static float decode(const char* data, int len, bool binary) {
+            if (binary && len == 4) {
+                uint32_t bits = load_be<uint32_t>(data);
+                float value;
+                std::memcpy(&value, &bits, sizeof(value));
+                return value;
+            }
+            return binary ? 0.0f : std::strtof(std::string(data, len).c_str(), nullptr);
+        }
+    };
+    
+    template <>
+    struct field<double> {
+        static double decode(const char* data, int len, bool binary) {
+            if (binary && len == 8) {
+                uint64_t bits = load_be<uint64_t>(data);
+                double value;
+                std::memcpy(&value, &bits, sizeof(value));
+                return value;
+            }
+            if (binary && len == 4) {
+                return field<float>::decode(data, len, binary);
+            }
+            return binary ? 0.0 : std::strtod(std::string(data, len).c_str(), nullptr);
+        }
+    };
+    
+    // text, varchar, bytea, json... binary and text formats are the same bytes
+    template <>
+    struct field<std::string_view> {
+        static std::string_view decode(const char* data, int len, bool) {
+            return std::string_view(data, len);
+        }
+    };
+    
+    template <>
+    struct field<std::string> {
+        static std::string decode(const char* data, int len, bool) {
+            return std::string(data, len);
+        }
+    };
+    
+    template <typename T>
+    struct field<std::optional<T>> {
+        static std::optional<T> decode(const char* data, int len, bool binary) {
+            return field<T>::decode(data, len, binary);
+        }
+    };
+    
+    // Owns PGresult, move-only
+    class result {
+    public:
+        template <typename... T>
+        class row_range;
+        
+        result() = default;
+        explicit result(PGresult* res): _res(res) {}
+        result(const result&) = delete;
+        result(result&& other): _res(other.release()) {}
+        ~result() {
+            clear();
+        }
+        
+        result& operator=(const result&) = delete;
+        result& operator=(result&& other) {
+            if (this != &other) {
+                clear();
+                _res = other.release();
+            }
+            return *this;
+        }
+        
+        PGresult* get() const {
+            return _res;
+        }
+        PGresult* release() {
+            PGresult* res = _res;
+            _res = nullptr;
+            return res;
+        }
+        void clear() {
+            if (_res) {
+                PQclear(_res);
+                _res = nullptr;
+            }
+        }
+        explicit operator bool() const {
+            return _res != nullptr;
+        }
+        
+        ExecStatusType status() const {
+            return _res ? PQresultStatus(_res) : PGRES_FATAL_ERROR;
+        }
+        bool ok() const {
+            ExecStatusType s = status();
+            return s == PGRES_COMMAND_OK || s == PGRES_TUPLES_OK || s == PGRES_SINGLE_TUPLE;
+        }
+        const char* error() const {
+            return _res ? PQresultErrorMessage(_res) : "no result";
+        }
+        int size() const {
+            return _res ? PQntuples(_res) : 0;
+        }
+        int columns() const {
+            return _res ? PQnfields(_res) : 0;
+        }
+        bool is_null(int row, int col) const {
+            return PQgetisnull(_res, row, col);
+        }
+        
+        template <typename T>
+        T get(int row, int col) const {
+            if (PQgetisnull(_res, row, col)) {
+                return T();
+            }
+            return field<T>::decode(PQgetvalue(_res, row, col), PQgetlength(_res, row, col),
+                                    PQfformat(_res, col) == 1);
+        }
+        
+        // for(auto [id, name, male]: res.rows<int64_t, std::string_view, bool>())
+        // Columns are taken from the left, values point into the result
+        template <typename... T>
+        row_range<T...> rows() const {
+            return row_range<T...>(*this);
+        }
+        
+    private:
+        PGresult* _res = nullptr;
+    };
+    
+    template <typename... T>
+    class result::row_range {
+    public:
+        using value_type = std::tuple<T...>;
+        
+        class iterator {
+        public:
+            iterator(const result& res, int row): _res(res), _row(row) {}
+            value_type operator*() const {
+                return decode(std::index_sequence_for<T...>());
+            }
+            iterator& operator++() {
+                ++_row;
+                return *this;
+            }
+            bool operator!=(const iterator& other) const {
+                return _row != other._row;
+            }
+        private:
+            template <std::size_t... I>
+            value_type decode(std::index_sequence<I...>) const {
+                return value_type(_res.get<T>(_row, (int)I)...);
+            }
+            const result& _res;
+            int _row;
+        };
+        
+        explicit row_range(const result& res): _res(res) {}
+        iterator begin() const {
+            return iterator(_res, 0);
+        }
+        iterator end() const {
+            return iterator(_res, _res.size());
+        }
+        
+    private:
+        const result& _res;
+    };
+    
+    using results_t = std::vector<result>;
+    
+    // Adapts handler taking owned results to query::callback_t
+    template <typename F>
+    inline callback<void(std::list<PGresult*>)> owned(F handler) {
+        return [handler = std::move(handler)](std::list<PGresult*> results) mutable {
+            results_t owned;
+            owned.reserve(results.size());
+            for(auto r: results) {
+                owned.emplace_back(r);
+            }
+            handler(std::move(owned));
+        };
+    }
+}
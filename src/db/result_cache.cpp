@@ -0,0 +1,195 @@
+#include "result_cache.hpp"
+#include <algorithm>
+
+namespace db {
+
+    // Bookkeeping of an entry on top of its results and key
+    static constexpr std::size_t entry_overhead = 128;
+
+    result_cache::result_cache(std::size_t budget, counters* stats)
+    : _budget(budget), _stats(stats) {}
+
+    result_cache::~result_cache() {
+        clear();
+    }
+
+    bool result_cache::cacheable(const query& q) {
+        return q.cache_ttl().count() > 0 && !q.is_streaming() && !q.is_exclusive();
+    }
+
+    std::string result_cache::encode(const query& q) {
+        std::string key;
+        key += q.is_binary_results() ? 'b' : 't';
+        for(auto& p: q.params()) {
+            Oid oid = p.oid();
+            key.append((const char*)&oid, sizeof(oid));
+            if (!p.data()) {
+                key += 'n';
+                continue;
+            }
+            uint64_t len = p.len();
+            key += p.is_binary() ? 'b' : 't';
+            key.append((const char*)&len, sizeof(len));
+            key.append((const char*)p.data(), p.len());
+        }
+        return key;
+    }
+
+    bool result_cache::serve(query& q, std::list<PGresult*>& hit) {
+        std::string params = encode(q);
+        results_t cached;
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            generation = _generation;
+            auto sql = _index.find(q.sql());
+            if (sql != _index.end()) {
+                auto found = sql->second.find(params);
+                if (found != sql->second.end()) {
+                    auto it = found->second;
+                    if (clock::now() < it->expires) {
+                        _lru.splice(_lru.begin(), _lru, it);
+                        cached = it->results;
+                    }
+                    else {
+                        erase(it);
+                    }
+                }
+            }
+        }
+
+        if (cached) {
+            // PQcopyResult always copies the command tag along
+            for(auto r: *cached) {
+                PGresult* copy = PQcopyResult(r, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+                if (!copy) {
+                    break;
+                }
+                hit.push_back(copy);
+            }
+            if (hit.size() == cached->size()) {
+                if (_stats) {
+                    _stats->hits.fetch_add(1, std::memory_order_relaxed);
+                }
+                return true;
+            }
+            // out of memory, run the query instead
+            for(auto r: hit) {
+                PQclear(r);
+            }
+            hit.clear();
+        }
+
+        if (_stats) {
+            _stats->misses.fetch_add(1, std::memory_order_relaxed);
+        }
+        q.on_done([this, sql = q.sql(), params = std::move(params), ttl = q.cache_ttl(), generation,
+                   handler = q.take_handler()](std::list<PGresult*> results) mutable {
+            store(std::move(sql), std::move(params), results, ttl, generation);
+            if (handler) {
+                handler(std::move(results));
+            }
+            else {
+                for(auto r: results) {
+                    PQclear(r);
+                }
+            }
+        });
+        return false;
+    }
+
+    void result_cache::store(std::string sql, std::string params, const std::list<PGresult*>& results,
+                             std::chrono::milliseconds ttl, uint64_t generation) {
+        if (results.empty()) {
+            return;
+        }
+        std::size_t bytes = entry_overhead + 2 * sql.size() + 2 * params.size();
+        for(auto r: results) {
+            if (PQresultStatus(r) != PGRES_TUPLES_OK) {
+                return;
+            }
+            bytes += PQresultMemorySize(r);
+        }
+        if (bytes > _budget) {
+            return;
+        }
+
+        // Copied outside the lock, the handler gets the originals
+        auto copies = new std::vector<PGresult*>();
+        for(auto r: results) {
+            copies->push_back(PQcopyResult(r, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES));
+        }
+        bool copied = std::find(copies->begin(), copies->end(), nullptr) == copies->end();
+        results_t cached(copies, [](const std::vector<PGresult*>* list) {
+            for(auto r: *list) {
+                PQclear(r);
+            }
+            delete list;
+        });
+        if (!copied) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (generation != _generation) {
+            return;
+        }
+        auto by_sql = _index.find(sql);
+        if (by_sql != _index.end()) {
+            auto found = by_sql->second.find(params);
+            if (found != by_sql->second.end()) {
+                erase(found->second);
+            }
+        }
+        while (_bytes + bytes > _budget && _lru.size()) {
+            erase(std::prev(_lru.end()));
+            if (_stats) {
+                _stats->evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        _lru.push_front(entry{sql, params, std::move(cached), clock::now() + ttl, bytes});
+        _index[std::move(sql)][std::move(params)] = _lru.begin();
+        _bytes += bytes;
+        if (_stats) {
+            _stats->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+    void result_cache::erase(std::list<entry>::iterator it) {
+        auto sql = _index.find(it->sql);
+        sql->second.erase(it->params);
+        if (sql->second.empty()) {
+            _index.erase(sql);
+        }
+        _bytes -= it->bytes;
+        if (_stats) {
+            _stats->bytes.fetch_sub(it->bytes, std::memory_order_relaxed);
+        }
+        // results are cleared once no hit is copying them any more
+        _lru.erase(it);
+    }
+
+    void result_cache::invalidate(const std::string& sql) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        ++_generation;
+        auto found = _index.find(sql);
+        if (found == _index.end()) {
+            return;
+        }
+        std::vector<std::list<entry>::iterator> entries;
+        for(auto& e: found->second) {
+            entries.push_back(e.second);
+        }
+        for(auto it: entries) {
+            erase(it);
+        }
+    }
+
+    void result_cache::clear() {
+        std::lock_guard<std::mutex> lock(_mtx);
+        ++_generation;
+        while (_lru.size()) {
+            erase(_lru.begin());
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <libpq-fe.h>
+#include "query.hpp"
+
+namespace db {
+
+    // Results of queries with query::cache_for() keyed by SQL text and param
+    // bytes, see pool_options::result_cache. Only row returning results of
+    // successful queries are kept, least recently used ones are dropped to stay
+    // within budget bytes. Thread safe, results are copied in and out, so
+    // handlers own what they get as usual
+    class result_cache {
+    public:
+        struct counters {
+            std::atomic<uint64_t> hits{0};
+            std::atomic<uint64_t> misses{0};
+            // dropped to stay within the budget
+            std::atomic<uint64_t> evictions{0};
+            std::atomic<int64_t> bytes{0};
+        };
+
+        result_cache(std::size_t budget, counters* stats = nullptr);
+        result_cache(const result_cache&) = delete;
+        ~result_cache();
+
+        // Queries with a ttl which are not streamed, COPY or transactions
+        static bool cacheable(const query& q);
+        // On hit returns true with copies of the cached results. On miss the
+        // handler of q is wrapped to store the results once q succeeds
+        bool serve(query& q, std::list<PGresult*>& hit);
+        // Drops results of sql for any params. Results of queries in flight
+        // are not stored, so they cannot bring back what was invalidated
+        void invalidate(const std::string& sql);
+        void clear();
+
+    private:
+        using clock = std::chrono::steady_clock;
+        using results_t = std::shared_ptr<const std::vector<PGresult*>>;
+
+        struct entry {
+            std::string sql;
+            std::string params;
+            results_t results;
+            clock::time_point expires;
+            std::size_t bytes;
+        };
+
+        // Param types, formats and values together with the result format
+        static std::string encode(const query& q);
+        void store(std::string sql, std::string params, const std::list<PGresult*>& results,
+                   std::chrono::milliseconds ttl, uint64_t generation);
+        void erase(std::list<entry>::iterator it);
+
+        std::mutex _mtx;
+        std::list<entry> _lru;
+        std::unordered_map<std::string, std::unordered_map<std::string, std::list<entry>::iterator>> _index;
+        std::size_t _budget;
+        std::size_t _bytes = 0;
+        // Changed by invalidation, results of queries sent before are dropped
+        uint64_t _generation = 0;
+        counters* _stats;
+    };
+}
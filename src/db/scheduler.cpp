@@ -0,0 +1,108 @@
+#include "scheduler.hpp"
+#include <algorithm>
+
+namespace db {
+    
+    scheduler::scheduler(const weights_t& weights): _weights(weights) {}
+    
+    void scheduler::push(query&& q) {
+        level& l = _levels[(int)q.priority()];
+        flow& f = l.flows[q.tag()];
+        if (f.queue.empty()) {
+            f.tag = q.tag();
+            auto w = _weights.find(f.tag);
+            f.weight = w == _weights.end() ? 1 : std::max(1u, w->second);
+            f.deficit = 0;
+            l.active.push_back(&f);
+        }
+        f.queue.push_back(std::move(q));
+        ++_size;
+    }
+    
+    bool scheduler::pop(query& q, bool high_only) {
+        int levels = high_only ? 1 : 3;
+        for (int i = 0; i < levels; ++i) {
+            level& l = _levels[i];
+            if (l.active.empty()) {
+                continue;
+            }
+            flow* f = l.active.front();
+            // New round of the flow, it may send weight queries in a row.
+            // A flow owing queries merged by extract() sits out rounds
+            while (f->deficit <= 0) {
+                f->deficit += f->weight;
+                if (f->deficit <= 0) {
+                    l.active.pop_front();
+                    l.active.push_back(std::move(f));
+                    f = l.active.front();
+                }
+            }
+            q = std::move(f->queue.front());
+            f->queue.pop_front();
+            --_size;
+            if (f->queue.empty()) {
+                l.active.pop_front();
+            }
+            else {
+                charge(l, *f, 1);
+            }
+            return true;
+        }
+        return false;
+    }
+    
+    void scheduler::split(std::vector<query>& out) {
+        for(auto& l: _levels) {
+            std::vector<flow*> emptied;
+            for (std::size_t i = 0; i < l.active.size(); ++i) {
+                flow* f = l.active[i];
+                std::size_t count = (f->queue.size() + 1) / 2;
+                std::size_t from = f->queue.size() - count;
+                for (std::size_t j = from; j < f->queue.size(); ++j) {
+                    out.push_back(std::move(f->queue[j]));
+                }
+                f->queue.truncate(from);
+                _size -= count;
+                if (f->queue.empty()) {
+                    emptied.push_back(f);
+                }
+            }
+            for(auto f: emptied) {
+                retire(l, *f);
+            }
+        }
+    }
+    
+    void scheduler::clear(std::vector<query>& out) {
+        for(auto& l: _levels) {
+            for (std::size_t i = 0; i < l.active.size(); ++i) {
+                flow* f = l.active[i];
+                for (std::size_t j = 0; j < f->queue.size(); ++j) {
+                    out.push_back(std::move(f->queue[j]));
+                }
+                f->queue.clear();
+            }
+            l.active.clear();
+        }
+        _size = 0;
+    }
+    
+    void scheduler::charge(level& l, flow& f, std::size_t count) {
+        bool spent = f.deficit > 0 && f.deficit <= (long)count;
+        f.deficit -= (long)count;
+        // the flow is at the head of the round robin while its round lasts
+        if (spent && l.active.front() == &f) {
+            l.active.pop_front();
+            l.active.push_back(&f);
+        }
+    }
+    
+    void scheduler::retire(level& l, flow& f) {
+        for (std::size_t i = 0; i < l.active.size(); ++i) {
+            if (l.active[i] == &f) {
+                l.active.erase(i, i + 1);
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "fifo.hpp"
+#include "query.hpp"
+
+namespace db {
+    
+    // Backlog of one event loop. Priority classes are served strictly in order,
+    // inside a class tags share the connections by weight (deficit round robin),
+    // queries of one tag stay FIFO
+    class scheduler {
+    public:
+        using weights_t = std::unordered_map<uint32_t, unsigned>;
+        
+        // Tags without weight get 1
+        explicit scheduler(const weights_t& weights = weights_t());
+        
+        void push(query&& q);
+        // Next query by priority and weight. With high_only only high priority is served
+        bool pop(query& q, bool high_only = false);
+        
+        // Moves queries of the same tag and priority as q, found among the next
+        // window ones and accepted by pred, to out until it holds limit queries
+        template <typename Pred>
+        void extract(const query& q, std::size_t window, std::size_t limit, Pred&& pred, std::vector<query>& out) {
+            level& l = _levels[(int)q.priority()];
+            auto it = l.flows.find(q.tag());
+            if (it == l.flows.end()) {
+                return;
+            }
+            fifo<query>& queue = it->second.queue;
+            window = std::min(queue.size(), window);
+            std::size_t w = 0;
+            for (std::size_t r = 0; r < window; ++r) {
+                query& other = queue[r];
+                if (out.size() < limit && pred(other)) {
+                    out.push_back(std::move(other));
+                }
+                else {
+                    if (w != r) {
+                        queue[w] = std::move(other);
+                    }
+                    ++w;
+                }
+            }
+            _size -= window - w;
+            queue.erase(w, window);
+            if (queue.empty()) {
+                retire(l, it->second);
+            }
+            else {
+                charge(l, it->second, window - w);
+            }
+        }
+        
+        // Newest half of every tag, for another loop to steal
+        void split(std::vector<query>& out);
+        // Moves everything out in no particular order
+        void clear(std::vector<query>& out);
+        
+        std::size_t size() const {
+            return _size;
+        }
+        bool empty() const {
+            return _size == 0;
+        }
+        
+    private:
+        struct flow {
+            uint32_t tag = 0;
+            unsigned weight = 1;
+            // Queries left in the round, below 0 the flow owes later rounds
+            long deficit = 0;
+            fifo<query> queue;
+        };
+        struct level {
+            // Flows stay after they ran empty, their queues are reused
+            std::unordered_map<uint32_t, flow> flows;
+            // Flows with queries, served round robin
+            fifo<flow*> active;
+        };
+        
+        // Takes an emptied flow out of the round robin
+        void retire(level& l, flow& f);
+        // Counts count more queries of f against its round
+        void charge(level& l, flow& f, std::size_t count);
+        
+        weights_t _weights;
+        level _levels[3];
+        std::size_t _size = 0;
+    };
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace db {
+    
+    // Contiguous vector keeping up to N elements inside the object
+    template <typename T, std::size_t N>
+    class small_vector {
+    public:
+        using value_type = T;
+        using iterator = T*;
+        using const_iterator = const T*;
+        
+        small_vector() = default;
+        small_vector(std::initializer_list<T> items) {
+            reserve(items.size());
+            for(auto& item: items) {
+                push_back(item);
+            }
+        }
+        template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+        small_vector(It first, It last) {
+            for (; first != last; ++first) {
+                push_back(*first);
+            }
+        }
+        small_vector(const small_vector& other) {
+            reserve(other._size);
+            for(auto& item: other) {
+                push_back(item);
+            }
+        }
+        small_vector(small_vector&& other) noexcept {
+            take(other);
+        }
+        ~small_vector() {
+            release();
+        }
+        
+        small_vector& operator=(const small_vector& other) {
+            if (this != &other) {
+                clear();
+                reserve(other._size);
+                for(auto& item: other) {
+                    push_back(item);
+                }
+            }
+            return *this;
+        }
+        small_vector& operator=(small_vector&& other) noexcept {
+            if (this != &other) {
+                release();
+                take(other);
+            }
+            return *this;
+        }
+        
+        T* data() {
+            return _heap ? _heap : reinterpret_cast<T*>(&_inline);
+        }
+        const T* data() const {
+            return _heap ? _heap : reinterpret_cast<const T*>(&_inline);
+        }
+        iterator begin() {
+            return data();
+        }
+        iterator end() {
+            return data() + _size;
+        }
+        const_iterator begin() const {
+            return data();
+        }
+        const_iterator end() const {
+            return data() + _size;
+        }
+        T& operator[](std::size_t i) {
+            return data()[i];
+        }
+        const T& operator[](std::size_t i) const {
+            return data()[i];
+        }
+        std::size_t size() const {
+            return _size;
+        }
+        bool empty() const {
+            return _size == 0;
+        }
+        
+        void reserve(std::size_t capacity) {
+            if (capacity <= _capacity) {
+                return;
+            }
+            T* heap = static_cast<T*>(::operator new(capacity * sizeof(T)));
+            T* items = data();
+            for (std::size_t i = 0; i < _size; ++i) {
+                new (heap + i) T(std::move(items[i]));
+                items[i].~T();
+            }
+            if (_heap) {
+                ::operator delete(_heap);
+            }
+            _heap = heap;
+            _capacity = capacity;
+        }
+        
+        template <typename... Args>
+        T& emplace_back(Args&&... args) {
+            if (_size == _capacity) {
+                reserve(_capacity * 2);
+            }
+            T* item = new (data() + _size) T(std::forward<Args>(args)...);
+            ++_size;
+            return *item;
+        }
+        void push_back(const T& item) {
+            emplace_back(item);
+        }
+        void push_back(T&& item) {
+            emplace_back(std::move(item));
+        }
+        
+        void clear() {
+            T* items = data();
+            for (std::size_t i = 0; i < _size; ++i) {
+                items[i].~T();
+            }
+            _size = 0;
+        }
+        
+    private:
+        void release() {
+            clear();
+            if (_heap) {
+                ::operator delete(_heap);
+                _heap = nullptr;
+            }
+            _capacity = N;
+        }
+        
+        // other is left empty with inline capacity
+        void take(small_vector& other) {
+            if (other._heap) {
+                _heap = other._heap;
+                _size = other._size;
+                _capacity = other._capacity;
+                other._heap = nullptr;
+                other._size = 0;
+                other._capacity = N;
+                return;
+            }
+            T* items = other.data();
+            for (std::size_t i = 0; i < other._size; ++i) {
+                new (data() + i) T(std::move(items[i]));
+                items[i].~T();
+            }
+            _size = other._size;
+            other._size = 0;
+        }
+        
+        typename std::aligned_storage<sizeof(T) * N, alignof(T)>::type _inline;
+        T* _heap = nullptr;
+        std::size_t _size = 0;
+        std::size_t _capacity = N;
+    };
+}
@@ -0,0 +1,59 @@
+#include "statement_cache.hpp"
+
+namespace db {
+    
+    statement_cache::statement_cache(std::size_t capacity, counters* stats)
+    : _capacity(capacity), _stats(stats) {}
+    
+    const std::string* statement_cache::find(const std::string& key) {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            if (_stats) {
+                _stats->misses.fetch_add(1, std::memory_order_relaxed);
+            }
+            return nullptr;
+        }
+        if (_stats) {
+            _stats->hits.fetch_add(1, std::memory_order_relaxed);
+        }
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return &it->second->second;
+    }
+    
+    const std::string& statement_cache::insert(const std::string& key, std::string& evicted) {
+        evicted.clear();
+        if (_lru.size() >= _capacity) {
+            auto& last = _lru.back();
+            evicted = std::move(last.second);
+            _index.erase(last.first);
+            _lru.pop_back();
+            if (_stats) {
+                _stats->evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        _lru.emplace_front(key, "alpq_" + std::to_string(++_next));
+        _index[key] = _lru.begin();
+        return _lru.front().second;
+    }
+    
+    void statement_cache::erase(const std::string& key, const std::string& name) {
+        auto it = _index.find(key);
+        if (it != _index.end() && it->second->second == name) {
+            _lru.erase(it->second);
+            _index.erase(it);
+        }
+    }
+    
+    void statement_cache::clear() {
+        _lru.clear();
+        _index.clear();
+    }
+    
+    bool statement_cache::enabled() const {
+        return _capacity > 0;
+    }
+    
+    std::size_t statement_cache::size() const {
+        return _lru.size();
+    }
+}
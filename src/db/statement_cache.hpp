@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace db {
+    
+    // Bounded LRU of server side prepared statements keyed by SQL text together
+    // with the param types and formats the statement was prepared for.
+    // Owned by a single connection, only the counters may be read from other threads.
+    class statement_cache {
+    public:
+        struct counters {
+            std::atomic<uint64_t> hits{0};
+            std::atomic<uint64_t> misses{0};
+            std::atomic<uint64_t> evictions{0};
+        };
+        
+        statement_cache(std::size_t capacity = 0, counters* stats = nullptr);
+        statement_cache(const statement_cache&) = delete;
+        statement_cache(statement_cache&& other) = default;
+        
+        statement_cache& operator=(const statement_cache&) = delete;
+        statement_cache& operator=(statement_cache&& other) = default;
+        
+        // Returns statement name and marks it as recently used, nullptr on miss
+        const std::string* find(const std::string& key);
+        // Adds new statement and returns its name. If the cache is full the least
+        // recently used statement is dropped and its name is stored in evicted
+        const std::string& insert(const std::string& key, std::string& evicted);
+        // Drops statement only if it is still cached under the given name
+        void erase(const std::string& key, const std::string& name);
+        // Forget every statement, e.g. when server session is gone
+        void clear();
+        
+        bool enabled() const;
+        std::size_t size() const;
+        
+    private:
+        using entry_t = std::pair<std::string, std::string>; // key, name
+        std::list<entry_t> _lru;
+        std::unordered_map<std::string, std::list<entry_t>::iterator> _index;
+        std::size_t _capacity;
+        uint64_t _next = 0;
+        counters* _stats;
+    };
+}
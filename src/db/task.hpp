@@ -0,0 +1,223 @@
+#pragma once
+
+// C++20 coroutine support, the header is empty for older standards
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <utility>
+#include "../logger/logger.hpp"
+
+namespace db {
+    
+    // Free lists of coroutine frames by 64 byte size class, shared by all
+    // threads: frames are mostly allocated by the thread starting a coroutine
+    // and freed by the loop or executor thread resuming it for the last time
+    class frame_pool {
+    public:
+        static constexpr std::size_t granularity = 64;
+        static constexpr std::size_t classes = 16;
+        static constexpr std::size_t max_cached = 256;
+        
+        static void* allocate(std::size_t size) {
+            std::size_t c = (size + granularity - 1) / granularity;
+            if (c < classes) {
+                bucket& b = shared().buckets[c];
+                std::lock_guard<std::mutex> lock(b.mtx);
+                if (b.head) {
+                    node* n = b.head;
+                    b.head = n->next;
+                    --b.count;
+                    return n;
+                }
+                size = c * granularity;
+            }
+            if (void* p = std::malloc(size)) {
+                return p;
+            }
+            throw std::bad_alloc();
+        }
+        
+        static void deallocate(void* p, std::size_t size) {
+            std::size_t c = (size + granularity - 1) / granularity;
+            if (c < classes) {
+                bucket& b = shared().buckets[c];
+                std::lock_guard<std::mutex> lock(b.mtx);
+                if (b.count < max_cached) {
+                    node* n = static_cast<node*>(p);
+                    n->next = b.head;
+                    b.head = n;
+                    ++b.count;
+                    return;
+                }
+            }
+            std::free(p);
+        }
+        
+    private:
+        struct node {
+            node* next;
+        };
+        struct bucket {
+            std::mutex mtx;
+            node* head = nullptr;
+            std::size_t count = 0;
+        };
+        struct lists {
+            bucket buckets[classes];
+        };
+        // Never destroyed, detached tasks may still finish while the program exits
+        static lists& shared() {
+            static lists* l = new lists();
+            return *l;
+        }
+    };
+    
+    template <typename T>
+    class task;
+    
+    namespace detail {
+        
+        struct task_promise_base {
+            static void* operator new(std::size_t size) {
+                return frame_pool::allocate(size);
+            }
+            static void operator delete(void* p, std::size_t size) {
+                frame_pool::deallocate(p, size);
+            }
+            
+            // Resumes whoever awaits the task, a detached task destroys itself
+            struct final_awaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+                    task_promise_base& p = h.promise();
+                    if (p.detached) {
+                        if (p.error) {
+                            log_error("[db] detached task failed with exception");
+                        }
+                        h.destroy();
+                        return std::noop_coroutine();
+                    }
+                    return p.continuation ? p.continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+            final_awaiter final_suspend() noexcept {
+                return {};
+            }
+            void unhandled_exception() {
+                error = std::current_exception();
+            }
+            
+            std::coroutine_handle<> continuation;
+            std::exception_ptr error;
+            bool detached = false;
+        };
+        
+        template <typename T>
+        struct task_promise: task_promise_base {
+            task<T> get_return_object();
+            template <typename U>
+            void return_value(U&& v) {
+                value.emplace(std::forward<U>(v));
+            }
+            T take() {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                return std::move(*value);
+            }
+            std::optional<T> value;
+        };
+        
+        template <>
+        struct task_promise<void>: task_promise_base {
+            task<void> get_return_object();
+            void return_void() {}
+            void take() {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        };
+    }
+    
+    // Lazy coroutine, starts when awaited or detached. Frames come from frame_pool:
+    //     db::task<void> handle(db::connection_pool& pool) {
+    //         auto user = co_await pool.query("SELECT ...");
+    //         co_await pool.query("UPDATE ...");
+    //     }
+    //     handle(pool).detach();
+    template <typename T = void>
+    class task {
+    public:
+        using promise_type = detail::task_promise<T>;
+        using handle_t = std::coroutine_handle<promise_type>;
+        
+        explicit task(handle_t h): _handle(h) {}
+        task(task&& other) noexcept: _handle(std::exchange(other._handle, nullptr)) {}
+        task(const task&) = delete;
+        ~task() {
+            if (_handle) {
+                _handle.destroy();
+            }
+        }
+        
+        task& operator=(task&& other) noexcept {
+            if (this != &other) {
+                if (_handle) {
+                    _handle.destroy();
+                }
+                _handle = std::exchange(other._handle, nullptr);
+            }
+            return *this;
+        }
+        task& operator=(const task&) = delete;
+        
+        bool await_ready() const noexcept {
+            return !_handle || _handle.done();
+        }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            _handle.promise().continuation = awaiting;
+            return _handle;
+        }
+        T await_resume() {
+            return _handle.promise().take();
+        }
+        
+        // Runs the task to completion on its own, the frame is freed at the end
+        void detach() {
+            handle_t h = std::exchange(_handle, nullptr);
+            h.promise().detached = true;
+            h.resume();
+        }
+        
+    private:
+        handle_t _handle;
+    };
+    
+    namespace detail {
+        template <typename T>
+        task<T> task_promise<T>::get_return_object() {
+            return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+        }
+        
+        inline task<void> task_promise<void>::get_return_object() {
+            return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,51 @@
+#include "transaction.hpp"
+
+namespace db {
+
+    transaction::transaction(callback_t on_done, std::string begin)
+    : _begin(std::move(begin)), _on_done(std::move(on_done)) {}
+
+    transaction& transaction::add(query&& statement) {
+        _statements.push_back(std::move(statement));
+        return *this;
+    }
+
+    transaction& transaction::add(std::string sql, query::params_t params, query::callback_t handler) {
+        _statements.emplace_back(std::move(sql), std::move(params), std::move(handler));
+        return *this;
+    }
+
+    const std::string& transaction::begin() const {
+        return _begin;
+    }
+
+    std::vector<query>& transaction::statements() {
+        return _statements;
+    }
+
+    std::size_t transaction::size() const {
+        return _statements.size();
+    }
+
+    void transaction::fail(const std::string& error) {
+        if (_error.empty()) {
+            _error = error.empty() ? "transaction failed" : error;
+        }
+    }
+
+    void transaction::complete(const std::list<PGresult*>& results) {
+        bool committed = _error.empty() && results.size();
+        for(auto r: results) {
+            committed = committed && PQresultStatus(r) == PGRES_COMMAND_OK;
+            PQclear(r);
+        }
+        if (!committed && _error.empty()) {
+            _error = "transaction was not executed";
+        }
+
+        if (_on_done) {
+            _on_done(committed, _error);
+            _on_done = nullptr;
+        }
+    }
+}
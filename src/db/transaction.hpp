@@ -0,0 +1,46 @@
+#pragma once
+
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+#include <libpq-fe.h>
+#include "query.hpp"
+
+namespace db {
+
+    // Statements run between BEGIN and COMMIT on one connection. The whole group
+    // is pipelined and sent at once, so it takes a single round trip unless it
+    // fails. On the first error the rest is skipped and the transaction is rolled back
+    class transaction {
+    public:
+        // committed is false if the transaction was rolled back or not executed
+        using callback_t = std::function<void(bool committed, const std::string& error)>;
+
+        // begin may carry options, e.g. "BEGIN ISOLATION LEVEL SERIALIZABLE"
+        transaction(callback_t on_done, std::string begin = "BEGIN");
+        transaction(transaction&& other) = default;
+        transaction& operator=(transaction&& other) = default;
+
+        // Statements run in the order they were added. Handlers run like handlers
+        // of queries, statements skipped after an error get a PGRES_PIPELINE_ABORTED
+        // result and none if the connection was lost. Streaming is not supported
+        transaction& add(query&& statement);
+        transaction& add(std::string sql, query::params_t params, query::callback_t handler);
+
+        const std::string& begin() const;
+        std::vector<query>& statements();
+        std::size_t size() const;
+
+        // Loop side. Keeps the first error
+        void fail(const std::string& error);
+        // Called with the outcome of the transaction, clears results
+        void complete(const std::list<PGresult*>& results);
+
+    private:
+        std::string _begin;
+        std::vector<query> _statements;
+        std::string _error;
+        callback_t _on_done;
+    };
+}
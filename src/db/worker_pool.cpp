@@ -0,0 +1,93 @@
+#include "worker_pool.hpp"
+#include "../logger/logger.hpp"
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <stdexcept>
+
+namespace db {
+    
+    struct worker_pool::worker {
+        worker(std::size_t capacity): ring(capacity) {
+            eventfd = ::eventfd(0, EFD_CLOEXEC);
+            if (eventfd == -1) {
+                log_error("[db] failed to create eventfd");
+                throw std::runtime_error("failed to create worker pool");
+            }
+        }
+        
+        ~worker() {
+            close(eventfd);
+        }
+        
+        void notify() {
+            if (!notified.exchange(true, std::memory_order_acq_rel)) {
+                uint64_t one = 1;
+                write(eventfd, &one, sizeof(one));
+            }
+        }
+        
+        mpsc_ring<task_t> ring;
+        std::atomic<bool> notified{false};
+        std::atomic<bool> stop{false};
+        int eventfd;
+        std::thread thr;
+    };
+    
+    worker_pool::worker_pool(int threads, std::size_t capacity) {
+        for (int i = 0; i < std::max(1, threads); ++i) {
+            _workers.emplace_back(new worker(capacity));
+        }
+        for(auto& w: _workers) {
+            w->thr = std::thread(&worker_pool::run, this, std::ref(*w));
+        }
+    }
+    
+    worker_pool::~worker_pool() {
+        stop();
+    }
+    
+    void worker_pool::post(task_t task) {
+        worker& w = *_workers[_next.fetch_add(1, std::memory_order_relaxed) % _workers.size()];
+        if (w.stop.load(std::memory_order_acquire) || !w.ring.push(std::move(task))) {
+            task();
+            return;
+        }
+        w.notify();
+    }
+    
+    void worker_pool::stop() {
+        for(auto& w: _workers) {
+            w->stop.store(true, std::memory_order_release);
+            uint64_t one = 1;
+            write(w->eventfd, &one, sizeof(one));
+        }
+        for(auto& w: _workers) {
+            if (w->thr.joinable()) {
+                w->thr.join();
+            }
+            // Posted while the worker was exiting
+            w->ring.drain([](task_t&& task) {
+                task_t run = std::move(task);
+                run();
+            });
+        }
+    }
+    
+    void worker_pool::run(worker& w) {
+        while (true) {
+            uint64_t counter;
+            read(w.eventfd, &counter, sizeof(counter));
+            // Reset before draining, so a task posted during the drain triggers new wakeup
+            w.notified.exchange(false, std::memory_order_acq_rel);
+            bool stop = w.stop.load(std::memory_order_acquire);
+            w.ring.drain([](task_t&& task) {
+                // Captured state is released right after the run, not when the cell is reused
+                task_t run = std::move(task);
+                run();
+            });
+            if (stop) {
+                break;
+            }
+        }
+    }
+}
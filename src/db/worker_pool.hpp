@@ -0,0 +1,32 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "executor.hpp"
+#include "mpsc_ring.hpp"
+
+namespace db {
+    
+    // Fixed number of threads running posted tasks. Every worker has its own
+    // lock-free ring, posting threads spread tasks round robin
+    class worker_pool: public executor {
+    public:
+        worker_pool(int threads, std::size_t capacity = 1 << 14);
+        ~worker_pool();
+        
+        // Runs task on the calling thread if the chosen worker is full
+        void post(task_t task) override;
+        // Runs what was posted and joins the threads
+        void stop();
+        
+    private:
+        struct worker;
+        
+        void run(worker& w);
+        
+        std::vector<std::unique_ptr<worker>> _workers;
+        std::atomic<std::size_t> _next{0};
+    };
+}
@@ -1,52 +1,245 @@
 #include "logger.hpp"
+#include "../db/mpsc_ring.hpp"
+#include <atomic>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
-#include <iostream>
-#include <sstream>
-
-enum class log_level {
-    error, info
-};
-
-static void write_log(log_level level, const char* log) {
-    
-    // get time
-    std::time_t now = std::time(nullptr);
-    struct tm local = *localtime(&now);
-    char time[50];
-    strftime(time, sizeof(time), "[%Y-%m-%d %H:%M:%S] ", &local);
-    
-    std::stringstream final_log;
-    final_log << time << log << std::endl;
-    
-    // print log to console
-    if (level == log_level::error) {
-        std::cerr << final_log.str();
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace {
+
+    struct record {
+        log_level level = log_level::info;
+        std::time_t time = 0;
+        std::size_t len = 0;
+        char text[log_line_size];
+    };
+
+    std::atomic<int> enabled_level{(int)log_level::info};
+
+    void write_all(int fd, const std::string& data) {
+        std::size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return;
+            }
+            written += n;
+        }
     }
-    else {
-        std::cout << final_log.str();
+
+    // Formats "[%Y-%m-%d %H:%M:%S] ", localtime is called once per second
+    class timestamp {
+    public:
+        const char* format(std::time_t time) {
+            if (time != _time) {
+                struct tm local;
+                localtime_r(&time, &local);
+                strftime(_text, sizeof(_text), "[%Y-%m-%d %H:%M:%S] ", &local);
+                _time = time;
+            }
+            return _text;
+        }
+    private:
+        std::time_t _time = -1;
+        char _text[32];
+    };
+
+    class async_logger {
+    public:
+        async_logger(): _ring(2048) {
+            _eventfd = eventfd(0, EFD_CLOEXEC);
+            if (_eventfd != -1) {
+                _thread = std::thread(&async_logger::run, this);
+            }
+            else {
+                _stop.store(true);
+            }
+        }
+
+        // Never destroyed, loop threads may still log during static destruction
+        static async_logger& instance() {
+            static async_logger* logger = [] {
+                auto created = new async_logger();
+                std::atexit([] {
+                    instance().stop();
+                });
+                return created;
+            }();
+            return *logger;
+        }
+
+        void push(record& r) {
+            if (_stop.load(std::memory_order_acquire)) {
+                // writer is gone, write on the calling thread
+                timestamp stamp;
+                std::string line;
+                append(line, stamp, r);
+                write_all(r.level == log_level::error ? 2 : 1, line);
+                return;
+            }
+            if (!_ring.push(std::move(r))) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            _pushed.fetch_add(1, std::memory_order_release);
+            if (!_notified.exchange(true, std::memory_order_acq_rel)) {
+                uint64_t one = 1;
+                ::write(_eventfd, &one, sizeof(one));
+            }
+        }
+
+        uint64_t dropped() const {
+            return _dropped.load(std::memory_order_relaxed);
+        }
+
+        void flush() {
+            uint64_t target = _pushed.load(std::memory_order_acquire);
+            std::unique_lock<std::mutex> lock(_mtx_written);
+            _cv_written.wait(lock, [this, target] {
+                return _written >= target || _stopped;
+            });
+        }
+
+        void stop() {
+            if (_stop.exchange(true) || !_thread.joinable()) {
+                return;
+            }
+            uint64_t one = 1;
+            ::write(_eventfd, &one, sizeof(one));
+            _thread.join();
+            // Pushed while the writer was exiting
+            timestamp stamp;
+            std::string out;
+            std::string err;
+            record r;
+            while (_ring.pop(r)) {
+                append(r.level == log_level::error ? err : out, stamp, r);
+            }
+            write_all(1, out);
+            write_all(2, err);
+        }
+
+    private:
+        static void append(std::string& out, timestamp& stamp, const record& r) {
+            out += stamp.format(r.time);
+            out.append(r.text, r.len);
+            out += '\n';
+        }
+
+        void run() {
+            std::string out;
+            std::string err;
+            uint64_t reported = 0;
+            record r;
+            while (true) {
+                uint64_t counter;
+                read(_eventfd, &counter, sizeof(counter));
+                // Reset before draining, so a line pushed during the drain triggers new wakeup
+                _notified.exchange(false, std::memory_order_acq_rel);
+                bool stop = _stop.load(std::memory_order_acquire);
+                std::size_t count = 0;
+                // Lines pushed after stop are written by their callers
+                while (_ring.pop(r)) {
+                    append(r.level == log_level::error ? err : out, _timestamp, r);
+                    ++count;
+                }
+                uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+                if (dropped != reported) {
+                    char line[64];
+                    std::snprintf(line, sizeof(line), "[log] %llu lines dropped", (unsigned long long)(dropped - reported));
+                    err += _timestamp.format(std::time(nullptr));
+                    err += line;
+                    err += '\n';
+                    reported = dropped;
+                }
+                write_all(1, out);
+                write_all(2, err);
+                out.clear();
+                err.clear();
+                {
+                    std::lock_guard<std::mutex> lock(_mtx_written);
+                    _written += count;
+                    _stopped = stop;
+                }
+                _cv_written.notify_all();
+                if (stop) {
+                    break;
+                }
+            }
+        }
+
+        db::mpsc_ring<record> _ring;
+        std::atomic<bool> _notified{false};
+        std::atomic<bool> _stop{false};
+        std::atomic<uint64_t> _dropped{0};
+        std::atomic<uint64_t> _pushed{0};
+        int _eventfd;
+        std::thread _thread;
+        // Writer thread only
+        timestamp _timestamp;
+        // Lines written so far, for flush
+        std::mutex _mtx_written;
+        std::condition_variable _cv_written;
+        uint64_t _written = 0;
+        bool _stopped = false;
+    };
+
+    void submit(log_level level, const char* fmt, va_list args) {
+        if ((int)level > enabled_level.load(std::memory_order_relaxed)) {
+            return;
+        }
+        record r;
+        r.level = level;
+        r.time = std::time(nullptr);
+        int len = vsnprintf(r.text, sizeof(r.text), fmt, args);
+        if (len < 0) {
+            len = 0;
+        }
+        else if ((std::size_t)len >= sizeof(r.text)) {
+            // mark truncated lines
+            len = sizeof(r.text) - 1;
+            std::memcpy(r.text + len - 3, "...", 3);
+        }
+        r.len = len;
+        async_logger::instance().push(r);
     }
 }
 
 void log_error(const char* fmt, ...) {
-    
-    // get formatted log
-    char log[1024];
     va_list args;
     va_start(args, fmt);
-    vsprintf(log, fmt, args);
+    submit(log_level::error, fmt, args);
     va_end(args);
-    
-    write_log(log_level::error, log);
 }
 
+#if LOGGER_LEVEL >= 1
 void log_info(const char* fmt, ...) {
-    // get formatted log
-    char log[1024];
     va_list args;
     va_start(args, fmt);
-    vsprintf(log, fmt, args);
+    submit(log_level::info, fmt, args);
     va_end(args);
-    
-    write_log(log_level::info, log);
+}
+#endif
+
+void log_set_level(log_level level) {
+    enabled_level.store((int)level, std::memory_order_relaxed);
+}
+
+uint64_t log_dropped() {
+    return async_logger::instance().dropped();
+}
+
+void log_flush() {
+    async_logger::instance().flush();
 }
@@ -1,6 +1,33 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
-void log_error(const char* fmt, ...);
-void log_info(const char* fmt, ...);
+enum class log_level {
+    error, info
+};
+
+// Levels above LOGGER_LEVEL are compiled out, -DLOGGER_LEVEL=0 keeps errors only
+#ifndef LOGGER_LEVEL
+#define LOGGER_LEVEL 1
+#endif
+
+// Lines are formatted on the calling thread and written by a background thread
+// in batches. When its queue is full lines are dropped and counted, the caller
+// never blocks. Lines longer than log_line_size are truncated
+void log_error(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+#if LOGGER_LEVEL >= 1
+void log_info(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+#else
+inline void log_info(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+inline void log_info(const char*, ...) {}
+#endif
+
+// Lines above level are skipped before formatting
+void log_set_level(log_level level);
+// Lines dropped because the queue was full
+uint64_t log_dropped();
+// Waits until every line logged so far is written
+void log_flush();
+
+constexpr std::size_t log_line_size = 480;
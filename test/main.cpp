@@ -1,6 +1,9 @@
 #include <iostream>
 #include <unistd.h>
+#include <atomic>
 #include "../src/db/connection_pool.hpp"
+#include "../src/db/result.hpp"
+#include "../src/db/bind.hpp"
 
 void mainLoop(PGconn* conn);
 void handleResult(PGresult* res, bool print_table = false);
@@ -8,13 +11,31 @@ void stressTest(db::connection_pool& pool);
 
 void testIncorrectQueryies(db::connection_pool& pool);
 void testCorrectQuery(db::connection_pool& pool);
+void testStreamingQuery(db::connection_pool& pool);
+void testCopyIn(db::connection_pool& pool);
+void testTypedRows(db::connection_pool& pool);
+void testTypedParams(db::connection_pool& pool);
+void testTransaction(db::connection_pool& pool);
+void testNotify(db::connection_pool& pool);
+void testCachedQuery(db::connection_pool& pool);
+void testCompletionWorkers();
 
 int main(int argc, const char * argv[]) {
     
-    db::connection_pool pool(10);
+//    testCompletionWorkers();
+    db::pool_options options;
+//    options.result_cache = 16 << 20;
+    db::connection_pool pool(10, options);
     stressTest(pool);
 //    testIncorrectQueryies(pool);
 //    testCorrectQuery(pool);
+//    testStreamingQuery(pool);
+//    testCopyIn(pool);
+//    testTypedRows(pool);
+//    testTypedParams(pool);
+//    testTransaction(pool);
+//    testNotify(pool);
+//    testCachedQuery(pool);
     pool.run({
         {"host", "localhost"},
         {"hostaddr", "127.0.0.1"},
@@ -29,6 +50,23 @@ int main(int argc, const char * argv[]) {
     std::cout << "finish" << std::endl;
     return 0;
 }
+// Handlers run on two completion workers instead of the loop thread,
+// handleResult prints whole tables
+void testCompletionWorkers() {
+    db::pool_options options;
+    options.completion_threads = 2;
+    db::connection_pool pool(2, options);
+    testCorrectQuery(pool);
+    pool.run({
+        {"host", "localhost"},
+        {"hostaddr", "127.0.0.1"},
+        {"dbname", "sample"},
+        {"user", "sample"},
+        {"password", "123"}
+    });
+    std::cin.get();
+    pool.stop();
+}
 void testCorrectQuery(db::connection_pool& pool) {
     pool.async_query(db::query("SELECT * FROM users LIMIT 5", [](std::list<PGresult*> result){
         for(auto& r: result) {
@@ -36,6 +74,115 @@ void testCorrectQuery(db::connection_pool& pool) {
         }
     }));
 }
+void testStreamingQuery(db::connection_pool& pool) {
+    db::query q("SELECT * FROM users", [](std::list<PGresult*> result){
+        for(auto& r: result) {
+            handleResult(r);
+        }
+    });
+    q.stream([count = 0](const PGresult* rows) mutable {
+        count += PQntuples(rows);
+        std::cout << "streamed " << count << " rows" << std::endl;
+        // stop after first thousand rows
+        return count < 1000;
+    });
+    pool.async_query(std::move(q));
+}
+void testTypedRows(db::connection_pool& pool) {
+    db::query q("SELECT id, name, male FROM users WHERE id > $1", {
+        db::query::param::int64(0)
+    }, db::owned([](db::results_t results){
+        for(auto& r: results) {
+            if (!r.ok()) {
+                std::cout << r.error() << std::endl;
+                continue;
+            }
+            for(auto [id, name, male]: r.rows<int64_t, std::string_view, bool>()) {
+                std::cout << id << " " << name << " " << male << std::endl;
+            }
+        }
+    }));
+    q.binary_results();
+    pool.async_query(std::move(q));
+}
+
+void testTypedParams(db::connection_pool& pool) {
+    pool.async_query(db::make_query<int64_t, std::string_view, bool>(
+        DB_SQL("INSERT INTO users(id, name, male) VALUES ($1, $2, $3)"), 1000, "john", true,
+        [](std::list<PGresult*> result){
+            for(auto& r: result) {
+                handleResult(r);
+            }
+        }));
+}
+
+void testCachedQuery(db::connection_pool& pool) {
+    auto lookup = [&pool](db::query::callback_t handler) {
+        db::query q("SELECT name, male FROM users WHERE id = $1", {db::query::param::int64(1000)},
+                    std::move(handler));
+        pool.async_query(std::move(q.cache_for(std::chrono::seconds(10))));
+    };
+    lookup([lookup, &pool](std::list<PGresult*> result) {
+        for(auto& r: result) {
+            handleResult(r, true);
+        }
+        // answered from memory
+        lookup([&pool](std::list<PGresult*> result) {
+            for(auto& r: result) {
+                handleResult(r, true);
+            }
+            std::cout << "cache hits: " << pool.cache_stats().hits << std::endl;
+        });
+    });
+}
+
+void testTransaction(db::connection_pool& pool) {
+    auto print = [](std::list<PGresult*> result) {
+        for(auto& r: result) {
+            handleResult(r);
+        }
+    };
+    db::transaction tx([](bool committed, const std::string& error) {
+        std::cout << (committed ? "committed" : "rolled back: " + error) << std::endl;
+    });
+    tx.add(db::make_query<int64_t, std::string_view, bool>(
+        DB_SQL("INSERT INTO users(id, name, male) VALUES ($1, $2, $3)"), 1001, "jane", false, print));
+    tx.add(db::query("UPDATE users SET male = NOT male WHERE id = 1001", print));
+    pool.async_transaction(std::move(tx));
+}
+
+void testNotify(db::connection_pool& pool) {
+    pool.subscribe("users_changed", [](const db::notification& n) {
+        std::cout << n.channel << " from " << n.pid << ": " << n.payload << std::endl;
+    });
+    pool.async_query(db::query("NOTIFY users_changed, 'jane'", [](std::list<PGresult*> result) {
+        for(auto& r: result) {
+            handleResult(r);
+        }
+    }));
+}
+
+void testCopyIn(db::connection_pool& pool) {
+    auto copy = pool.copy_from("COPY users(name, male) FROM STDIN (FORMAT csv)",
+                               [](int64_t rows, const std::string& error) {
+        if (rows < 0) {
+            std::cout << "copy failed: " << error << std::endl;
+        }
+        else {
+            std::cout << "copied " << rows << " rows" << std::endl;
+        }
+    });
+    std::thread([copy]{
+        for (int i = 0; i < 100; ++i) {
+            std::string batch;
+            for (int j = 0; j < 1000; ++j) {
+                batch += std::to_string(i * j) + "," + ((i * j % 3) ? "t" : "f") + "\n";
+            }
+            copy->write(std::move(batch));
+        }
+        copy->finish();
+    }).detach();
+}
 void testIncorrectQueryies(db::connection_pool& pool) {
     pool.async_query(db::query("SELLLLL", [](std::list<PGresult*> result){
         for(auto& r: result) {